@@ -0,0 +1,374 @@
+//==============================================================================
+//
+// Title:		curvifit.h
+// Purpose:		Interface of the fitting library (libcurvifit). Contains no
+//				LabWindows/CVI dependencies, so it can be linked into the GUI,
+//				the command line tool or any other C/C++ program.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+#ifndef __curvifit_H__
+#define __curvifit_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+
+//==============================================================================
+// Include files
+
+#include <stddef.h>
+
+
+//==============================================================================
+// Constants
+
+#define MAXPAR		11		// Max no. of fit parameters (polynomial of degree 10).
+
+enum fittype {LIN, EXP, POLY, GAUSS, LOG, LN, NFITTYPES};
+
+enum fitmethod {
+	FIT_LM,					// Levenberg-Marquardt (damped Gauss-Newton). Linear models are solved directly.
+	FIT_GRADIENT			// Steepest descent line search (the original algorithm).
+};
+
+// Data features a model can use from the workspace, computed once per dataset.
+enum fitfeature {
+	FIT_FEAT_LOGX	= 1		// log |x| of X.
+};
+
+// Columns of a dataset, as flags.
+enum datacolumn {
+	DATA_X			= 1,
+	DATA_DX			= 2,
+	DATA_Y			= 4,
+	DATA_DY			= 8
+};
+
+enum fitstatus {
+	FIT_OK			=  0,
+	FIT_ERR_NOMIN	= -1,	// Can't minimize chi^2 (iteration limit reached).
+	FIT_ERR_ARGS	= -2,	// Invalid arguments (no. of points/parameters).
+	FIT_ERR_DOMAIN	= -3,	// Data outside the model's domain (e.g. x <= 0 for LOG).
+	FIT_ERR_MEMORY	= -4,	// Out of memory.
+	FIT_ERR_FILE	= -5,	// Can't open/read input file.
+	FIT_ERR_FORMAT	= -6,	// Input data is in wrong format.
+	FIT_ERR_NAN		= -7,	// chi^2 or its gradient is NaN or infinite (model undefined at the parameters, or bad data).
+	FIT_ERR_BUDGET	= -8	// Time or evaluation budget exceeded (fitoptions.maxtime, maxeval).
+};
+
+
+//==============================================================================
+// Types
+
+// Fitted function signature: f (x, a, na).
+typedef double (*fitfunc)(double, double *, int);
+
+// Array kernel of a model: evaluates it on the n points of X into Y.
+struct fitmodel;
+typedef void (*fitarrayfunc)(const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+
+// Slope kernel of a model: its array kernel, that also stores the derivatives df/dx at X into D.
+typedef void (*fitslopefunc)(const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na);
+
+// Residual kernel of a model: weighted residuals r and sigmas s of the len points from i0 of the data
+// bound to ws, as computed by CalcChi2Ws. sigma^2 = dy^2 + (df/dx dx)^2 for models with a slope kernel,
+// else dy^2 + ( ( f(x+dx) - f(x-dx) ) / 2 )^2.
+struct fitworkspace;
+typedef void (*fitresidualfunc)(const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+								double a[], int na, double r[], double s[]);
+
+// A model in dual numbers (see fitdual.h): f at x, with its derivatives by the na parameters a.
+struct dual;
+typedef struct dual (*fitdualfunc)(double x, const struct dual *a, int na);
+
+// Jacobian kernel of a model: the residuals r and sigmas s of its residual kernel, and the derivatives
+// J[j][i] of residual i by parameter j.
+typedef void (*fitjacobianfunc)(const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+								double a[], int na, double r[], double s[], double *J[]);
+
+// Work done by a fit, and where its time went.
+struct fitstats {
+	long long nchi2;				// chi^2 evaluations over the data (not counting remembered values).
+	long long neval;				// Model evaluations: 3 per point and chi^2 with x errors and no
+									// slope kernel, else 1.
+	long long ncut;					// Rejected steps: line search halvings and LM damping increases.
+	double tfit;					// Seconds in GeneralFitWs...
+	double thessian;				// ...of which computing the errors and covariance.
+	double tguess;					// Seconds in InitialGuess, if the fit was started by FitBatch or
+									// FitSessionRefit (or the caller filled it in).
+};
+
+// One iteration of a fit, as recorded in a fittrace.
+struct fittracepoint {
+	int iter;
+	double chi2;
+	double step;					// Length of the parameter step that led here.
+	double a[MAXPAR];
+};
+
+// Ring buffer of the last cap iterations of a fit (see fitoptions.trace), owned by the caller:
+// point k of the fit is points[k % cap], for n - cap <= k < n.
+struct fittrace {
+	int cap;
+	struct fittracepoint *points;
+	int n;							// No. of points recorded, set by the fit.
+};
+
+struct fitparameters {
+	int status;
+	int iter;
+	int na;
+	double a[MAXPAR];
+	double aerr[MAXPAR];
+	double cov[MAXPAR * MAXPAR];	// na x na matrix, row major: cov[i * na + j].
+	double chisq;
+	int ndf;
+	double rchisq;
+	double pprob;
+	double stepsize[MAXPAR];		// Parameter steps of the gradient method (see fitoptions.warm).
+	struct fitstats stats;
+};
+
+struct fitmodel {
+	int type;
+	const char *name;
+	const char *desc;
+	const char *formula;
+	int na;							// No. of parameters, 0 if chosen by the caller (POLY).
+	fitfunc func;					// NULL for formulas (see FitExprInit), which have funcarray.
+	fitarrayfunc funcarray;			// NULL to evaluate func point by point.
+	fitresidualfunc residuals;		// NULL to compute residuals from funcarray/func.
+	int features;					// fitfeature flags the residual kernel can use.
+	int linear;						// 1 if f = sum a_k x^k (LIN, POLY): solved directly by FIT_LM.
+	fitdualfunc dual;				// NULL to differentiate the model numerically. Not used with slope.
+	fitjacobianfunc jacobian;		// NULL to compute the Jacobian from dual.
+	fitslopefunc slope;				// NULL to take the x errors through f (x +- dx).
+	const void *data;				// The model's own data for its kernels (its fitexpr), or NULL.
+};
+
+// Model compiled from a formula by FitExprInit.
+struct exprprog;
+struct fitexpr {
+	struct fitmodel model;
+	char *text;						// "y = " and the formula: model.formula.
+	struct exprprog *value;			// Programs computing f,
+	struct exprprog *slope;			// f and df/dx,
+	struct exprprog *grad;			// f and its derivatives by the parameters,
+	struct exprprog *gradslope;		// and all of them with those of df/dx. slope and gradslope are NULL
+									// for formulas too large to differentiate twice.
+};
+
+struct fitoptions {
+	int method;						// fitmethod.
+	int maxiter;					// Max no. of iterations, 0 for the method's default.
+	int nthreads;					// Max no. of threads, 0 for one per CPU.
+	const struct fitparameters *warm;	// Previous fit to start from, or NULL (see GeneralFitWs).
+	int nstarts;					// No. of starting points around the initial parameters, 0 or 1
+									// for just them. The best minimum is kept.
+	struct fittrace *trace;			// Records the iterations of the fit, or NULL.
+	double atol;					// Stop when chi^2 changes by no more than atol: 1e-5 by default, 0 to
+									// go on until it doesn't change at all.
+	double rtol;					// Also stop when chi^2 changes by no more than rtol * chi^2,
+	double xtol;					// or no parameter a moves by more than xtol * |a|,
+	double gtol;					// or the norm of the chi^2 gradient is at most gtol. 0 for unused.
+	double maxtime;					// Give up after this many seconds (FIT_ERR_BUDGET), 0 for no limit.
+	long long maxeval;				// Give up after this many model evaluations (see fitstats.neval),
+									// 0 for no limit.
+};
+
+// Reusable buffers of a fit, bound to a dataset. Zero before first use.
+// All the state of a fit is in its workspace: fits on different workspaces may run
+// concurrently, on any threads.
+struct fitworkspace {
+	int n;
+	int cap;
+	double *X;						// Bound data, not owned by the workspace.
+	double *dX;
+	double *Y;
+	double *dY;
+	int hasdx;						// 0 if all dX are 0 (x error terms are skipped).
+	double *res;					// Weighted residuals ( y - f(x) ) / sigma of the last CalcChi2Ws call.
+	double *sig;					// sigma of every point in the last CalcChi2Ws call.
+	int features;					// fitfeature flags cached for the bound data.
+	int logxcap;					// 0 if logx belongs to another workspace (FitWorkspaceShare).
+	double *logx;					// log |x| of X.
+};
+
+// Weighted linear least squares accumulator. Rows are added one at a time
+// and rotated into the upper triangular R (Givens QR), so no n x m design
+// matrix is ever stored.
+struct lsqacc {
+	int m;
+	double R[MAXPAR * MAXPAR];		// m x m upper triangular, row major.
+	double qty[MAXPAR];
+	double sse;
+};
+
+// Growable data table. The columns are parts of one block starting at X (see DatasetReserve).
+// A dataset with cap 0 and points is a view into memory it doesn't own (see OpenDataBinary).
+struct dataset {
+	int n;
+	int cap;
+	double *X;
+	double *dX;
+	double *Y;
+	double *dY;
+};
+
+// Live fit of a growing dataset (see FitSessionInit): points are appended as they're
+// acquired, and every cadence points the model is refitted starting from the last fit.
+struct fitsession {
+	const struct fitmodel *model;
+	int na;
+	int hasinita;					// 1 to start cold fits from inita, 0 from InitialGuess.
+	double inita[MAXPAR];
+	struct fitoptions opt;
+	int cadence;					// Refit every cadence appended points, 0 only on FitSessionRefit.
+	int window;						// Fit only the last window points, 0 for all of them.
+	int pending;					// Points appended since the last refit.
+	int nfits;						// No. of refits so far.
+	struct dataset data;			// All the points appended.
+	struct fitworkspace ws;
+	struct fitparameters fit;		// Last fit, valid if nfits > 0.
+};
+
+// Curves of n points each, fitted together by FitBatch. Curve k is X + k * xstride,
+// dX + k * dxstride, Y + k * ystride and dY + k * dystride: a stride of n packs the
+// curves one after the other, a stride of 0 shares the column (e.g. a common X grid).
+// Its fit starts from inita + k * initstride the same way, or from InitialGuess if inita
+// is NULL.
+struct fitbatch {
+	int ncurves;
+	int n;
+	double *X;
+	double *dX;
+	double *Y;
+	double *dY;
+	int xstride;
+	int dxstride;
+	int ystride;
+	int dystride;
+	double *inita;					// NULL for InitialGuess, required for models it doesn't know.
+	int initstride;
+};
+
+// Binary dataset file mapped into memory by OpenDataBinary.
+struct datamap {
+	struct dataset data;			// View of the columns.
+	char *buf;						// The whole file.
+	size_t len;
+	int mapped;						// 0 if buf was read into allocated memory instead.
+	double *conv;					// float columns converted to double.
+};
+
+// Contents of a plot rendered by WritePlotSvg.
+struct plotspec {
+	int width;						// Image size in pixels.
+	int height;
+	const char *title;				// Texts, or NULL.
+	const char *xlabel;
+	const char *ylabel;
+	const struct dataset *data;		// Points drawn with their error bars.
+	const struct fitmodel *model;	// Model of fita and inita.
+	int na;
+	const double *fita;				// Fitted parameters, or NULL for no fitted function.
+	const double *inita;			// Initial parameters, or NULL.
+	int residuals;					// 1 for a residuals graph (of fita) under the data graph.
+};
+
+
+//==============================================================================
+// Global functions
+
+// fitfunc.c
+double flin (double x, double a[], int na);
+double fexp (double x, double a[], int na);
+double fpoly (double x, double a[], int na);
+double fgauss (double x, double a[], int na);
+double flog (double x, double a[], int na);
+double fln (double x, double a[], int na);
+const struct fitmodel *GetFitModel (int type);
+const struct fitmodel *FindFitModel (const char *name);
+const struct fitmodel *FindFitModelFunc (fitfunc func);
+void ModelEvalArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+
+// generalfit.c
+struct fitparameters GeneralFit (fitfunc func, double X[], double dX[], double Y[], double dY[],
+								 int n, double inita[], int na);
+struct fitparameters GeneralFitEx (fitfunc func, double X[], double dX[], double Y[], double dY[],
+								   int n, double inita[], int na, const struct fitoptions *opt);
+struct fitparameters GeneralFitWs (const struct fitmodel *model, struct fitworkspace *ws,
+								   double inita[], int na, const struct fitoptions *opt);
+void FitDefaultOptions (struct fitoptions *opt);
+int FitWorkspaceInit (struct fitworkspace *ws, double X[], double dX[], double Y[], double dY[], int n);
+int FitWorkspaceFeatures (struct fitworkspace *ws, int features);
+int FitWorkspaceShare (struct fitworkspace *ws, const struct fitworkspace *src);
+void FitWorkspaceFree (struct fitworkspace *ws);
+int WriteFitJson (const char *path, const struct fitparameters *fit, const struct fittrace *trace);
+double CalcChi2 (fitfunc func, double X[], double dX[], double Y[], double dY[], int n, double a[], int na);
+double CalcChi2Ws (const struct fitmodel *model, struct fitworkspace *ws, double a[], int na);
+void FEvalArray (fitfunc func, double Xin[], double Yout[], int n, double a[], int na);
+const char *FitStatusString (int status);
+
+// fitexpr.c
+int FitExprInit (struct fitexpr *e, const char *formula, int *errcol);
+void FitExprFree (struct fitexpr *e);
+
+// fitbatch.c
+int FitBatch (const struct fitmodel *model, int na, const struct fitbatch *b, const struct fitoptions *opt,
+			  struct fitparameters results[]);
+
+// fitsession.c
+int FitSessionInit (struct fitsession *s, const struct fitmodel *model, const double inita[], int na,
+					const struct fitoptions *opt, int cadence, int window);
+int FitSessionAppend (struct fitsession *s, double x, double dx, double y, double dy);
+int FitSessionAppendBlock (struct fitsession *s, double X[], double dX[], double Y[], double dY[], int n);
+int FitSessionRefit (struct fitsession *s);
+void FitSessionFree (struct fitsession *s);
+
+// fitplot.c
+int WritePlotSvg (const char *path, const struct plotspec *spec);
+
+// fitsample.c
+int SampleModel (const struct fitmodel *m, double a[], int na, double xmin, double xmax, int npix, double ytol,
+				 double X[], double Y[], int maxpts);
+
+// fitthread.c
+double FitClock (void);
+
+// fitguess.c
+int InitialGuess (int type, double X[], double Y[], double dY[], int n, double a[], int na);
+
+// fitmath.c
+int CholeskySolve (double A[], int n, double b[], double x[]);
+int CholeskyInvert (double A[], int n, double Ainv[]);
+int MatPseudoInvert (double A[], int n, double Ainv[]);
+void LsqInit (struct lsqacc *acc, int m);
+void LsqAddRow (struct lsqacc *acc, double row[], double y, double w);
+int LsqSolve (const struct lsqacc *acc, double coef[]);
+int LsqCovariance (const struct lsqacc *acc, double cov[]);
+double ChiSqProb (double chisq, int ndf);
+
+// dataio.c
+int ParseData (const char *buf, size_t len, struct dataset *data, int *errline, int *errcol);
+int ReadDataFile (const char *path, struct dataset *data, int *errline, int *errcol);
+int DatasetReserve (struct dataset *data, int cap);
+int DatasetAppend (struct dataset *data, double x, double dx, double y, double dy);
+int SelectDataRange (const struct dataset *data, double xmin, double xmax, struct dataset *out);
+void DatasetFree (struct dataset *data);
+int DataFileIsBinary (const char *path);
+int WriteDataBinary (const char *path, const struct dataset *data, int f32cols);
+int OpenDataBinary (const char *path, struct datamap *dm);
+void CloseDataBinary (struct datamap *dm);
+
+
+#ifdef __cplusplus
+	}
+#endif
+
+#endif  /* ndef __curvifit_H__ */
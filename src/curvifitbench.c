@@ -0,0 +1,271 @@
+//==============================================================================
+//
+// Title:		curvifitbench.c
+// Purpose:		Benchmark of the fitting library: fits seeded synthetic data
+//				of every model (and polynomial degree) at sizes from 10 points
+//				up, and prints the time and work of every fit as JSON.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Constants
+
+#define EXIT_USAGE		2
+#define DEFMAXN			1000000		// Largest data size by default...
+#define MAXN			100000000	// ...and at most.
+#define DEFMINTIME		0.2			// Fits are repeated for at least this many seconds...
+#define MAXREPS			1000		// ...up to this many times.
+#define BENCHDX			0.005		// X and Y errors of the synthetic data.
+#define BENCHDY			0.05
+
+//==============================================================================
+// Types
+
+// A model with the parameters and X range its synthetic data are drawn from.
+struct benchcase {
+	int type;
+	double xmin, xmax;
+	double a[MAXPAR];
+};
+
+//==============================================================================
+// Static global variables
+
+static const struct benchcase cases[] = {
+	{LIN,	0,		10,		{1.5, 2}},
+	{EXP,	0,		5,		{2, -0.6}},
+	{POLY,	-1,		1,		{1, -0.5, 0.33, -0.25, 0.2, -0.17, 0.14, -0.125, 0.11, -0.1, 0.09}},
+	{GAUSS,	-5,		5,		{3, 0.5, 1.2}},
+	{LOG,	0.5,	20,		{2, 1.5}},
+	{LN,	0.5,	20,		{2, 1.5}}
+};
+
+//==============================================================================
+// Static functions
+
+static void Usage (FILE *f) {
+
+	fprintf (f,
+			 "Usage: curvifit-bench [options]\n"
+			 "Fits synthetic data of every model at sizes 10, 100... and prints the runs as JSON.\n\n"
+			 "Options:\n"
+			 "  -m, --model NAME       only this model (lin, exp, poly, gauss, log or ln)\n"
+			 "      --max-n N          largest no. of points (default: %d)\n"
+			 "      --method NAME      lm (default) or gradient\n"
+			 "      --threads N        max no. of threads (default: one per CPU)\n"
+			 "      --starts N         no. of starting points (see curvifit-cli)\n"
+			 "      --seed N           seed of the synthetic data (default: 1)\n"
+			 "      --expr             fit every model compiled from its formula (FitExprInit) instead, but poly\n"
+			 "      --min-time SEC     repeat every fit for at least SEC seconds (default: %g)\n"
+			 "  -o, --output FILE      write the JSON to FILE instead of stdout\n"
+			 "  -h, --help             show this help\n", DEFMAXN, DEFMINTIME);
+}
+
+// xorshift64*: the same data on every platform for a seed, unlike rand.
+static double Uniform (uint64_t *state) {
+
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Standard normal deviate (Box-Muller).
+static double Normal (uint64_t *state) {
+	double u = Uniform (state);
+
+	return sqrt (-2 * log (1 - u)) * cos (6.283185307179586 * Uniform (state));
+}
+
+// JSON has no inf or NaN (e.g. chi^2_red with no degrees of freedom).
+static void PutNumber (FILE *f, const char *name, double x) {
+
+	if (isfinite (x))
+		fprintf (f, ", \"%s\": %.17g", name, x);
+	else
+		fprintf (f, ", \"%s\": null", name);
+}
+
+// n points of the model of c on an even grid over its X range, with normal noise of BENCHDY on Y.
+static void Generate (const struct benchcase *c, int na, int n, uint64_t seed, struct dataset *d) {
+	const struct fitmodel *m = GetFitModel (c->type);
+	double a[MAXPAR];
+	uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+	int i;
+
+	memcpy (a, c->a, sizeof (a));
+	for (i = 0; i < n; i++) {
+		d->X[i] = c->xmin + (c->xmax - c->xmin) * i / (n > 1 ? n - 1 : 1);
+		d->dX[i] = BENCHDX;
+		d->dY[i] = BENCHDY;
+	}
+	ModelEvalArray (m, d->X, d->Y, n, a, na);
+	for (i = 0; i < n; i++)
+		d->Y[i] += BENCHDY * Normal (&state);
+	d->n = n;
+}
+
+// Fits the data of c, repeatedly for mintime, and prints the run. With expr, the model is compiled
+// from its formula. Returns 0, or -1 if out of memory.
+static int Run (FILE *out, const struct benchcase *c, int degree, int n, uint64_t seed,
+				const struct fitoptions *opt, double mintime, int expr, int *first) {
+	const struct fitmodel *m = GetFitModel (c->type);
+	struct dataset d = {0};
+	struct fitworkspace ws = {0};
+	struct fitexpr e = {0};
+	struct fitparameters fit;
+	double a[MAXPAR], t0, t, tmin = HUGE_VAL, total = 0, tguess;
+	int na = m->na ? m->na : degree + 1, reps, status;
+
+	if (n < na)
+		return 0;				// Too few points for the model.
+	if (DatasetReserve (&d, n) < 0)
+		return -1;
+	Generate (c, na, n, seed, &d);
+	if (FitWorkspaceInit (&ws, d.X, d.dX, d.Y, d.dY, n) < 0 || (expr && FitExprInit (&e, m->formula, NULL) < 0)) {
+		FitWorkspaceFree (&ws);
+		DatasetFree (&d);
+		return -1;
+	}
+	if (expr)
+		m = &e.model;
+
+	// The initial guess is timed with the fit, as every caller needs one.
+	for (reps = 0; reps < MAXREPS && (reps == 0 || total < mintime); reps++) {
+		t0 = FitClock ();
+		status = InitialGuess (c->type, d.X, d.Y, d.dY, n, a, na);
+		tguess = FitClock () - t0;
+		if (status >= 0)
+			fit = GeneralFitWs (m, &ws, a, na, opt);
+		else {
+			memset (&fit, 0, sizeof (fit));
+			fit.status = status;
+		}
+		fit.stats.tguess = tguess;
+		t = FitClock () - t0;
+		total += t;
+		if (t < tmin)
+			tmin = t;
+	}
+
+	fprintf (out, "%s\n    {\"model\": \"%s\", \"degree\": %d, \"n\": %d, \"na\": %d, \"reps\": %d, "
+			 "\"wall_s\": %.9g, \"wall_min_s\": %.9g, \"guess_s\": %.9g, \"hessian_s\": %.9g, "
+			 "\"nchi2\": %lld, \"neval\": %lld, \"ncut\": %lld, \"iter\": %d",
+			 *first ? "" : ",", GetFitModel (c->type)->name, c->type == POLY ? degree : 0, n, na, reps, total / reps, tmin,
+			 fit.stats.tguess, fit.stats.thessian, fit.stats.nchi2, fit.stats.neval, fit.stats.ncut, fit.iter);
+	PutNumber (out, "chi2", fit.chisq);
+	PutNumber (out, "rchi2", fit.rchisq);
+	fprintf (out, ", \"status\": %d}", fit.status);
+	fflush (out);
+	*first = 0;
+
+	FitExprFree (&e);
+	FitWorkspaceFree (&ws);
+	DatasetFree (&d);
+	return 0;
+}
+
+//==============================================================================
+// Global functions
+
+int main (int argc, char *argv[])
+{
+	const struct fitmodel *only = NULL;
+	struct fitoptions opt;
+	const char *outpath = NULL;
+	double mintime = DEFMINTIME;
+	uint64_t seed = 1;
+	FILE *out = stdout;
+	int i, k, n, degree, maxn = DEFMAXN, expr = 0, first = 1;
+
+	FitDefaultOptions (&opt);
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp (argv[i], "-h") || !strcmp (argv[i], "--help")) {
+			Usage (stdout);
+			return 0;
+		}
+		else if ((!strcmp (argv[i], "-m") || !strcmp (argv[i], "--model")) && i + 1 < argc) {
+			if (!(only = FindFitModel (argv[++i]))) {
+				fprintf (stderr, "Unknown model '%s'.\n", argv[i]);
+				return EXIT_USAGE;
+			}
+		}
+		else if (!strcmp (argv[i], "--max-n") && i + 1 < argc)
+			maxn = atoi (argv[++i]);
+		else if (!strcmp (argv[i], "--method") && i + 1 < argc) {
+			i++;
+			if (!strcmp (argv[i], "lm"))
+				opt.method = FIT_LM;
+			else if (!strcmp (argv[i], "gradient"))
+				opt.method = FIT_GRADIENT;
+			else {
+				fprintf (stderr, "Unknown method '%s'.\n", argv[i]);
+				return EXIT_USAGE;
+			}
+		}
+		else if (!strcmp (argv[i], "--threads") && i + 1 < argc)
+			opt.nthreads = atoi (argv[++i]);
+		else if (!strcmp (argv[i], "--starts") && i + 1 < argc)
+			opt.nstarts = atoi (argv[++i]);
+		else if (!strcmp (argv[i], "--seed") && i + 1 < argc)
+			seed = strtoull (argv[++i], NULL, 10);
+		else if (!strcmp (argv[i], "--expr"))
+			expr = 1;
+		else if (!strcmp (argv[i], "--min-time") && i + 1 < argc)
+			mintime = atof (argv[++i]);
+		else if ((!strcmp (argv[i], "-o") || !strcmp (argv[i], "--output")) && i + 1 < argc)
+			outpath = argv[++i];
+		else {
+			Usage (stderr);
+			return EXIT_USAGE;
+		}
+	}
+
+	if (maxn < 10 || maxn > MAXN) {
+		fprintf (stderr, "--max-n must be between 10 and %d.\n", MAXN);
+		return EXIT_USAGE;
+	}
+	if (outpath && !(out = fopen (outpath, "w"))) {
+		fprintf (stderr, "%s: %s\n", outpath, FitStatusString (FIT_ERR_FILE));
+		return EXIT_USAGE;
+	}
+
+	fprintf (out, "{\n  \"method\": \"%s\", \"threads\": %d, \"starts\": %d, \"seed\": %llu, \"expr\": %d,\n  \"runs\": [",
+			 opt.method == FIT_LM ? "lm" : "gradient", opt.nthreads, opt.nstarts, (unsigned long long)seed, expr);
+
+	for (k = 0; k < (int)(sizeof (cases) / sizeof (cases[0])); k++) {
+		if ((only && only->type != cases[k].type) || (expr && cases[k].type == POLY))
+			continue;
+		for (degree = 1; degree <= (cases[k].type == POLY ? MAXPAR - 1 : 1); degree++)
+			for (n = 10; n <= maxn; n *= 10)
+				if (Run (out, &cases[k], degree, n, seed, &opt, mintime, expr, &first) < 0) {
+					fprintf (stderr, "%s\n", FitStatusString (FIT_ERR_MEMORY));
+					if (outpath)
+						fclose (out);
+					return EXIT_FAILURE;
+				}
+	}
+
+	fprintf (out, "\n  ]\n}\n");
+	if (outpath && fclose (out)) {
+		fprintf (stderr, "%s: %s\n", outpath, FitStatusString (FIT_ERR_FILE));
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
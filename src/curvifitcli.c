@@ -0,0 +1,339 @@
+//==============================================================================
+//
+// Title:		curvifitcli.c
+// Purpose:		Command line front end of the fitting library: fits a data
+//				file to a model and prints the results, with no GUI.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Constants
+
+#define EXIT_FITERR		1	// The fit failed.
+#define EXIT_USAGE		2	// Bad arguments or input data.
+#define PLOT_WIDTH		800	// Size of the --plot image.
+#define PLOT_HEIGHT		600
+#define TRACE_SIZE		256	// Last iterations written by --stats.
+
+//==============================================================================
+// Static functions
+
+static void Usage (FILE *f) {
+
+	fprintf (f,
+			 "Usage: curvifit-cli [options] datafile\n"
+			 "Fits a 4 column table (X, dX, Y, dY) to a model and prints the results.\n"
+			 "datafile is a text table or a binary dataset written by --convert.\n\n"
+			 "Options:\n"
+			 "  -m, --model NAME       lin, exp, poly, gauss, log or ln (default: lin)\n"
+			 "  -d, --degree N         polynomial degree, 1 to %d (default: 2)\n"
+			 "  -e, --expr FORMULA     fit a formula in x and a0, a1... instead, e.g. \"a0 * exp (-a1 * x) + a2\"\n"
+			 "      --init A0,A1...    initial parameters instead of the initial guess (default for --expr: 1)\n"
+			 "  -r, --range XMIN XMAX  fit only points with XMIN <= X <= XMAX\n"
+			 "      --method NAME      lm (Levenberg-Marquardt, default) or gradient\n"
+			 "      --starts N         fit from N starting points around the initial guess, keep the best\n"
+			 "      --threads N        max no. of threads (default: one per CPU)\n"
+			 "      --atol TOL         stop when chi^2 changes by no more than TOL (default: 1e-5)\n"
+			 "      --rtol TOL         also stop when chi^2 changes by no more than TOL * chi^2\n"
+			 "      --xtol TOL         also stop when no parameter a moves by more than TOL * |a|\n"
+			 "      --gtol TOL         also stop when the chi^2 gradient's norm is at most TOL\n"
+			 "      --max-time SEC     give up after SEC seconds\n"
+			 "      --max-evals N      give up after N model evaluations\n"
+			 "      --convert OUTFILE  write the data (in range) to a binary dataset file and exit\n"
+			 "      --float32          with --convert, store dX and dY as 32 bit floats\n"
+			 "      --plot FILE.svg    also draw the data, fit, initial fit and residuals to an SVG file\n"
+			 "      --stats FILE.json  also write the fit's work counters, timers and last iterations\n"
+			 "  -h, --help             show this help\n", MAXPAR - 1);
+}
+
+// Parses comma separated values into the first na parameters of a, at most. Returns 0, or -1 if a value
+// is bad or there are too many.
+static int ParseParams (const char *s, double a[], int na) {
+	char *end;
+	int k;
+
+	for (k = 0; *s; k++) {
+		if (k == na)
+			return -1;
+		a[k] = strtod (s, &end);
+		if (end == s || (*end && *end != ','))
+			return -1;
+		s = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+// Prints the parameters in the same layout as the GUI's fit results panel.
+static void PrintFit (const struct fitmodel *model, const struct fitparameters *init,
+					  const struct fitparameters *fit) {
+	int i, j, na = fit->na;
+
+	printf ("%s\n%s\n\nIteration no. %d\nInitial parameters' values:\n", model->desc, model->formula, fit->iter);
+	for (i = 0; i < na; i++)
+		printf ("a%d = %f\n", i, init->a[i]);
+	printf ("chi^2 = %f\nchi^2_red = %f\np_prob = %f\n\n", init->chisq, init->rchisq, init->pprob);
+
+	printf ("Fitted parameters' values:\n");
+	for (i = 0; i < na; i++)
+		printf ("a%d = %f ± %f\n", i, fit->a[i], fit->aerr[i]);
+	for (i = 0; i < na; i++)
+		for (j = i + 1; j < na; j++)
+			printf ("cov(a%d ,a%d) = %f\n", i, j, fit->cov[i * na + j]);
+	printf ("chi^2 = %f\nndf = %d\nchi^2_red = %f\np_prob = %f\n", fit->chisq, fit->ndf, fit->rchisq, fit->pprob);
+}
+
+//==============================================================================
+// Global functions
+
+int main (int argc, char *argv[])
+{
+	const struct fitmodel *model = GetFitModel (LIN);
+	struct dataset data = {0}, fitdata = {0};
+	struct fitparameters init, fit;
+	struct fitworkspace ws = {0};
+	struct fitexpr expr = {0};
+	struct fitoptions opt;
+	struct datamap map = {0};
+	const char *path = NULL, *convpath = NULL, *plotpath = NULL, *statspath = NULL, *formula = NULL, *initstr = NULL;
+	struct plotspec plot;
+	struct fittracepoint tracepts[TRACE_SIZE];
+	struct fittrace trace = {TRACE_SIZE, tracepts, 0};
+	double tguess;
+	double xmin = 0, xmax = 0;
+	int i, degree = 2, rangecheck = 0, na, status, errline = 0, errcol = 0, f32cols = 0;
+
+	FitDefaultOptions (&opt);
+	
+	for (i = 1; i < argc; i++) {
+		if (!strcmp (argv[i], "-h") || !strcmp (argv[i], "--help")) {
+			Usage (stdout);
+			return 0;
+		}
+		else if ((!strcmp (argv[i], "-m") || !strcmp (argv[i], "--model")) && i + 1 < argc) {
+			if (!(model = FindFitModel (argv[++i]))) {
+				fprintf (stderr, "Unknown model '%s'.\n", argv[i]);
+				return EXIT_USAGE;
+			}
+		}
+		else if ((!strcmp (argv[i], "-d") || !strcmp (argv[i], "--degree")) && i + 1 < argc)
+			degree = atoi (argv[++i]);
+		else if ((!strcmp (argv[i], "-e") || !strcmp (argv[i], "--expr")) && i + 1 < argc)
+			formula = argv[++i];
+		else if (!strcmp (argv[i], "--init") && i + 1 < argc)
+			initstr = argv[++i];
+		else if ((!strcmp (argv[i], "-r") || !strcmp (argv[i], "--range")) && i + 2 < argc) {
+			xmin = atof (argv[++i]);
+			xmax = atof (argv[++i]);
+			rangecheck = 1;
+		}
+		else if (!strcmp (argv[i], "--method") && i + 1 < argc) {
+			i++;
+			if (!strcmp (argv[i], "lm"))
+				opt.method = FIT_LM;
+			else if (!strcmp (argv[i], "gradient"))
+				opt.method = FIT_GRADIENT;
+			else {
+				fprintf (stderr, "Unknown method '%s'.\n", argv[i]);
+				return EXIT_USAGE;
+			}
+		}
+		else if (!strcmp (argv[i], "--starts") && i + 1 < argc)
+			opt.nstarts = atoi (argv[++i]);
+		else if (!strcmp (argv[i], "--threads") && i + 1 < argc)
+			opt.nthreads = atoi (argv[++i]);
+		else if (!strcmp (argv[i], "--atol") && i + 1 < argc)
+			opt.atol = atof (argv[++i]);
+		else if (!strcmp (argv[i], "--rtol") && i + 1 < argc)
+			opt.rtol = atof (argv[++i]);
+		else if (!strcmp (argv[i], "--xtol") && i + 1 < argc)
+			opt.xtol = atof (argv[++i]);
+		else if (!strcmp (argv[i], "--gtol") && i + 1 < argc)
+			opt.gtol = atof (argv[++i]);
+		else if (!strcmp (argv[i], "--max-time") && i + 1 < argc)
+			opt.maxtime = atof (argv[++i]);
+		else if (!strcmp (argv[i], "--max-evals") && i + 1 < argc)
+			opt.maxeval = atoll (argv[++i]);
+		else if (!strcmp (argv[i], "--convert") && i + 1 < argc)
+			convpath = argv[++i];
+		else if (!strcmp (argv[i], "--float32"))
+			f32cols = DATA_DX | DATA_DY;
+		else if (!strcmp (argv[i], "--plot") && i + 1 < argc)
+			plotpath = argv[++i];
+		else if (!strcmp (argv[i], "--stats") && i + 1 < argc)
+			statspath = argv[++i];
+		else if (argv[i][0] != '-' && !path)
+			path = argv[i];
+		else {
+			Usage (stderr);
+			return EXIT_USAGE;
+		}
+	}
+
+	if (!path) {
+		Usage (stderr);
+		return EXIT_USAGE;
+	}
+
+	if (model->type == POLY && (degree < 1 || degree > MAXPAR - 1)) {
+		fprintf (stderr, "Polynomial degree must be between 1 and %d.\n", MAXPAR - 1);
+		return EXIT_USAGE;
+	}
+	na = model->na ? model->na : degree + 1;
+
+	if (rangecheck && !(xmin < xmax)) {
+		fprintf (stderr, "xmin must be smaller than xmax.\n");
+		return EXIT_USAGE;
+	}
+
+	if (formula) {
+		if ((status = FitExprInit (&expr, formula, &errcol)) < 0) {
+			if (status == FIT_ERR_FORMAT)
+				fprintf (stderr, "Syntax error in the formula at column %d.\n", errcol);
+			else if (status == FIT_ERR_ARGS)
+				fprintf (stderr, "The formula must use the parameters a0, a1... up to at most a%d with none skipped, "
+						 "and not be too long.\n", MAXPAR - 1);
+			else
+				fprintf (stderr, "%s\n", FitStatusString (status));
+			return EXIT_USAGE;
+		}
+		model = &expr.model;
+		na = model->na;
+	}
+
+	// Formulas have no initial guess: they start from 1, or the given values.
+	memset (&init, 0, sizeof (init));
+	for (i = 0; i < na; i++)
+		init.a[i] = 1;
+	if (initstr && ParseParams (initstr, init.a, na) < 0) {
+		fprintf (stderr, "--init takes at most %d comma separated numbers.\n", na);
+		FitExprFree (&expr);
+		return EXIT_USAGE;
+	}
+
+	// Binary datasets are used in place: data is then a view of the mapped file.
+	if (DataFileIsBinary (path)) {
+		if ((status = OpenDataBinary (path, &map)) < 0) {
+			fprintf (stderr, "%s: %s\n", path, FitStatusString (status));
+			FitExprFree (&expr);
+			return EXIT_USAGE;
+		}
+		data = map.data;
+	}
+	else if ((status = ReadDataFile (path, &data, &errline, &errcol)) < 0) {
+		if (status == FIT_ERR_FORMAT)
+			fprintf (stderr, "%s:%d:%d: %s\n", path, errline, errcol, FitStatusString (status));
+		else
+			fprintf (stderr, "%s: %s\n", path, FitStatusString (status));
+		DatasetFree (&data);
+		FitExprFree (&expr);
+		return EXIT_USAGE;
+	}
+
+	if (rangecheck) {
+		status = SelectDataRange (&data, xmin, xmax, &fitdata);
+		DatasetFree (&data);
+		if (status < 0) {
+			fprintf (stderr, "%s\n", FitStatusString (status));
+			DatasetFree (&fitdata);
+			CloseDataBinary (&map);
+			FitExprFree (&expr);
+			return EXIT_USAGE;
+		}
+	}
+	else
+		fitdata = data;
+
+	if (convpath) {
+		if ((status = WriteDataBinary (convpath, &fitdata, f32cols)) < 0)
+			fprintf (stderr, "%s: %s\n", convpath, FitStatusString (status));
+		DatasetFree (&fitdata);
+		CloseDataBinary (&map);
+		FitExprFree (&expr);
+		return status < 0 ? EXIT_USAGE : 0;
+	}
+
+	if (fitdata.n < na) {
+		fprintf (stderr, "Number of data points must be at least the number of parameters (%d).\n", na);
+		DatasetFree (&fitdata);
+		CloseDataBinary (&map);
+		FitExprFree (&expr);
+		return EXIT_USAGE;
+	}
+
+	// Initial parameters and their goodness of fit.
+	tguess = FitClock ();
+	status = initstr || formula ? FIT_OK : InitialGuess (model->type, fitdata.X, fitdata.Y, fitdata.dY, fitdata.n, init.a, na);
+	tguess = FitClock () - tguess;
+	if (status < 0) {
+		fprintf (stderr, "Initial fit failed: %s\n", FitStatusString (status));
+		DatasetFree (&fitdata);
+		CloseDataBinary (&map);
+		FitExprFree (&expr);
+		return EXIT_FITERR;
+	}
+	if ((status = FitWorkspaceInit (&ws, fitdata.X, fitdata.dX, fitdata.Y, fitdata.dY, fitdata.n)) < 0) {
+		fprintf (stderr, "%s\n", FitStatusString (status));
+		DatasetFree (&fitdata);
+		CloseDataBinary (&map);
+		FitExprFree (&expr);
+		return EXIT_FITERR;
+	}
+	init.chisq = CalcChi2Ws (model, &ws, init.a, na);
+	init.ndf = fitdata.n - na;
+	init.rchisq = init.chisq / init.ndf;
+	init.pprob = ChiSqProb (init.chisq, init.ndf);
+
+	if (statspath)
+		opt.trace = &trace;
+	fit = GeneralFitWs (model, &ws, init.a, na, &opt);
+	fit.stats.tguess = tguess;
+	if (fit.status < 0)
+		fprintf (stderr, "Warning: %s\n", FitStatusString (fit.status));
+
+	PrintFit (model, &init, &fit);
+
+	if (statspath && (status = WriteFitJson (statspath, &fit, &trace)) < 0) {
+		fprintf (stderr, "%s: %s\n", statspath, FitStatusString (status));
+		if (fit.status >= 0)
+			fit.status = status;
+	}
+
+	if (plotpath) {
+		memset (&plot, 0, sizeof (plot));
+		plot.width = PLOT_WIDTH;
+		plot.height = PLOT_HEIGHT;
+		plot.title = model->formula;
+		plot.xlabel = "X";
+		plot.ylabel = "Y";
+		plot.data = &fitdata;
+		plot.model = model;
+		plot.na = na;
+		plot.fita = fit.a;
+		plot.inita = init.a;
+		plot.residuals = 1;
+		if ((status = WritePlotSvg (plotpath, &plot)) < 0) {
+			fprintf (stderr, "%s: %s\n", plotpath, FitStatusString (status));
+			if (fit.status >= 0)
+				fit.status = status;
+		}
+	}
+
+	FitWorkspaceFree (&ws);
+	DatasetFree (&fitdata);
+	CloseDataBinary (&map);
+	FitExprFree (&expr);
+	return fit.status < 0 ? EXIT_FITERR : 0;
+}
@@ -15,37 +15,25 @@
 #include <userint.h>
 
 #include "datafit.h"
-#include "generalfit.c"
 #include "datafitheader.h"
 
 //==============================================================================
 // Constants
 
-#define MAXLEN	1000	//	Max no. of points to fit/lines on file.
-
-enum fittype {LIN, EXP, POLY, GAUSS, LOG, LN};
-
-//==============================================================================
-// Types
-
-struct pointdata {
-	double X[MAXLEN];
-	double dX[MAXLEN];
-	double Xres[5000];
-	double Y[MAXLEN];
-	double dY[MAXLEN];
-};
+#define MAXCURVE	8192	//	Max no. of points of a plotted fitted function.
+#define NSTARTS	16		//	No. of starting points of the retry when the fit can't minimize chi^2.
 
 //==============================================================================
 // Static global variables
 
 static int mainpanel, graphpanel, fitpanel, respanel, axespanel, helppanel, graphmenu,
-	   		fittype, N, fitN, na, errplotX[MAXLEN], errplotY[MAXLEN], fitplot, dataplot,
+	   		fittype, N, fitN, na, *errplotX, *errplotY, fitplot, dataplot,
 			resplot, initfitplot, rangecheck, dataflag, fitflag, rangeflag, logerror;
-static struct pointdata data, fitdata;
-static double (*fitfun)();
+static struct dataset data, fitdata;
+static struct datamap datamap;		// Binary data file data is a view of.
+static fitfunc fitfun;
 static struct fitparameters fitpar, initfit;
-static char results[2000];
+static char results[2500];
 
 
 //==============================================================================
@@ -53,12 +41,15 @@ static char results[2000];
 
 static void ChangeDataRange ();
 static void GetTitles ();
+static void DataLoaded ();
+static int PlotCurve (double a[], int color);
+static void ResampleCurves ();
 
 
 
 static void ChangeDataRange () {
-	double offset, ymin, ymax, xmin, xmax;
-	int ixmin, ixmax, i, j, iymin, iymax;
+	double ymin, ymax, xmin, xmax;
+	int ixmin, ixmax, j, iymin, iymax;
 	
 	// Change X range if FITRANGE is selected. X points don't have to be in ascending order.
 	if (rangecheck) {
@@ -74,20 +65,17 @@ static void ChangeDataRange () {
 	else
 		MaxMin1D (data.X, N, &xmax, &ixmax, &xmin, &ixmin);
 	
-	// Copy points to fit to fitdata arrays.
-	for (i = 0, j = 0; i < N; i++) {	
-		if (data.X[i] >= xmin && data.X[i] <= xmax) {
-			fitdata.X[j] = data.X[i];
-			fitdata.dX[j] = data.dX[i];
-			fitdata.Y[j] = data.Y[i];
-			fitdata.dY[j] = data.dY[i];
-			j++;
-			if (data.X[i] <= 0)
-				logerror = 1;
-		}
+	// Copy points to fit to fitdata.
+	fitdata.n = 0;
+	if (SelectDataRange (&data, xmin, xmax, &fitdata) < 0) {
+		MessagePopup ("Error", "Out of memory.");
+		return;
 	}
+	for (j = 0; j < fitdata.n; j++)
+		if (fitdata.X[j] <= 0)
+			logerror = 1;
 	
-	fitN = j;  // No. of points to fit (points in fitdata).
+	fitN = fitdata.n;  // No. of points to fit (points in fitdata).
 
 	// Set graph axes according to min/max values.
 	xmin *= (xmin > 0) ? 0.9 : 1.1;
@@ -96,11 +84,7 @@ static void ChangeDataRange () {
 	ymin *= (ymin > 0) ? 0.9 : 1.1;
 	ymax *= (ymax > 0) ? 1.1 : 0.9;
 	SetAxisRange (graphpanel, GRAPHPANEL_GRAPH, VAL_MANUAL, xmin, xmax, VAL_MANUAL, ymin, ymax);
-	
-	// Generate a high resultion X vector for plotting fitted function.
-	offset = (xmax - xmin) / 5000;
-	for (i = 0; i < 5000; i++)
-		fitdata.Xres[i] = xmin + i * offset;
+	ResampleCurves ();
 	
 	rangeflag = 1;
 	
@@ -124,6 +108,77 @@ static void GetTitles () {
 	SetCtrlAttribute (respanel, RESPANEL_GRAPH, ATTR_LABEL_JUSTIFY, VAL_CENTER_JUSTIFIED);
 }
 
+// Removes the plot of the previous data and sizes the error bar plot handles for the N points
+// just read into data.
+static void DataLoaded () {
+	int i;
+	
+	if (dataplot) {
+		DeleteGraphPlot (graphpanel, GRAPHPANEL_GRAPH, dataplot, VAL_DELAYED_DRAW);
+		for (i = 0; i < N; i++) {
+			DeleteGraphPlot (graphpanel, GRAPHPANEL_GRAPH, errplotX[i], VAL_DELAYED_DRAW);
+			DeleteGraphPlot (graphpanel, GRAPHPANEL_GRAPH, errplotY[i], VAL_DELAYED_DRAW);
+		}
+		RefreshGraph (graphpanel, GRAPHPANEL_GRAPH);
+		dataplot = 0;
+	}
+	
+	N = data.n;
+	free (errplotX);
+	free (errplotY);
+	errplotX = calloc (N, sizeof (int));
+	errplotY = calloc (N, sizeof (int));
+	dataflag = errplotX && errplotY;
+	fitflag = rangeflag = 0;
+	if (!dataflag)
+		MessagePopup ("Error", "Out of memory.");
+}
+
+// Plots the fitted function with parameters a over the graph's X range, sampled for the
+// graph's size in pixels: more points where the curve bends. Returns the plot handle.
+static int PlotCurve (double a[], int color) {
+	double xmin, xmax, ymin, ymax, *X;
+	int xscaling, yscaling, width, height, n, plot = 0;
+	
+	GetAxisRange (graphpanel, GRAPHPANEL_GRAPH, &xscaling, &xmin, &xmax, &yscaling, &ymin, &ymax);
+	GetCtrlAttribute (graphpanel, GRAPHPANEL_GRAPH, ATTR_PLOT_AREA_WIDTH, &width);
+	GetCtrlAttribute (graphpanel, GRAPHPANEL_GRAPH, ATTR_PLOT_AREA_HEIGHT, &height);
+	
+	if (!(X = malloc (2 * MAXCURVE * sizeof (double)))) {
+		MessagePopup ("Error", "Out of memory.");
+		return 0;
+	}
+	
+	// Half a pixel off the curve at most.
+	n = SampleModel (FindFitModelFunc (fitfun), a, na, xmin, xmax, width, 0.5 * (ymax - ymin) / height,
+					 X, X + MAXCURVE, MAXCURVE);
+	if (n > 0)
+		plot = PlotXY (graphpanel, GRAPHPANEL_GRAPH, X, X + MAXCURVE, n,
+					   VAL_DOUBLE, VAL_DOUBLE, VAL_THIN_LINE, VAL_NO_POINT, VAL_SOLID, 1, color);
+	free (X);
+	
+	return plot;
+}
+
+// Samples the plotted fitted functions again, after the axes range changed.
+static void ResampleCurves () {
+	int visible;
+	
+	if (fitplot > 0) {
+		GetPlotAttribute (graphpanel, GRAPHPANEL_GRAPH, fitplot, ATTR_TRACE_VISIBLE, &visible);
+		DeleteGraphPlot (graphpanel, GRAPHPANEL_GRAPH, fitplot, VAL_DELAYED_DRAW);
+		if ((fitplot = PlotCurve (fitpar.a, VAL_RED)) > 0)
+			SetPlotAttribute (graphpanel, GRAPHPANEL_GRAPH, fitplot, ATTR_TRACE_VISIBLE, visible);
+	}
+	if (initfitplot > 0) {
+		GetPlotAttribute (graphpanel, GRAPHPANEL_GRAPH, initfitplot, ATTR_TRACE_VISIBLE, &visible);
+		DeleteGraphPlot (graphpanel, GRAPHPANEL_GRAPH, initfitplot, VAL_DELAYED_DRAW);
+		if ((initfitplot = PlotCurve (initfit.a, VAL_GREEN)) > 0)
+			SetPlotAttribute (graphpanel, GRAPHPANEL_GRAPH, initfitplot, ATTR_TRACE_VISIBLE, visible);
+	}
+	RefreshGraph (graphpanel, GRAPHPANEL_GRAPH);
+}
+
 //==============================================================================
 // Global variables
 
@@ -187,24 +242,32 @@ int CVICALLBACK OpenDataFile (int panel, int control, int event,
 	switch (event)							
 	{
 		case EVENT_COMMIT:
-			char filepath[500];
-			int f, fmtstatus;
+			char filepath[500], msg[200];
+			int status, errline, errcol;
 	
-			if (FileSelectPopupEx ("", "*.*", "*.csv; *.txt", "Select File", VAL_SELECT_BUTTON, 0, 1, filepath) == 1) {			   
-				if ((f = OpenFile (filepath, VAL_READ_ONLY, VAL_OPEN_AS_IS, VAL_ASCII)) > 0) {
-					for (N = 0; !eof(f) && N < MAXLEN; N++) {
-						fmtstatus = ScanFile (f, "%1f%1f%1f%1f", &data.X[N], &data.dX[N], &data.Y[N], &data.dY[N]);
-						if (fmtstatus < 4) {
-						MessagePopup ("Error", "Input data file is in wrong format.\nMake sure file contains a 4 column table.");
-						CloseFile (f);
+			if (FileSelectPopupEx ("", "*.*", "*.csv; *.txt; *.bin", "Select File", VAL_SELECT_BUTTON, 0, 1, filepath) == 1) {			   
+				DatasetFree (&data);
+				CloseDataBinary (&datamap);
+				if (DataFileIsBinary (filepath)) {
+					if ((status = OpenDataBinary (filepath, &datamap)) < 0) {
+						MessagePopup ("Error", FitStatusString (status));
+						dataflag = 0;
 						return -1;
-						}
 					}
-					CloseFile (f);
-					SetCtrlVal (mainpanel, MAINPANEL_DATAINPUT, filepath);
-					dataflag = 1;
-					fitflag = rangeflag = 0;
+					data = datamap.data;
 				}
+				else if ((status = ReadDataFile (filepath, &data, &errline, &errcol)) < 0) {
+					if (status == FIT_ERR_FORMAT) {
+						sprintf (msg, "Input data file is in wrong format (line %d, column %d).\nMake sure file contains a 4 column table.", errline, errcol);
+						MessagePopup ("Error", msg);
+					}
+					else
+						MessagePopup ("Error", FitStatusString (status));
+					dataflag = 0;
+					return -1;
+				}
+				SetCtrlVal (mainpanel, MAINPANEL_DATAINPUT, filepath);
+				DataLoaded ();
 			}
 			break;
 	}
@@ -218,8 +281,8 @@ int CVICALLBACK PasteData (int panel, int control, int event,
 	switch (event)
 	{
 		case EVENT_COMMIT:
-			int stravailable, n = 0, fmtstatus;
-			char *pastedstr, *str;
+			int stravailable, status, errline, errcol;
+			char *pastedstr, msg[200];
 			
 			ClipboardGetText (&pastedstr, &stravailable);
 			if (!stravailable) {
@@ -227,22 +290,25 @@ int CVICALLBACK PasteData (int panel, int control, int event,
 				return -1;
 			}
 			
-			str = pastedstr;					 
-			for (N = 0; N < MAXLEN && strlen (str) > 0; N++) {
-				fmtstatus = Scan (str, "%1f%1f%1f%1f", &data.X[N], &data.dX[N], &data.Y[N], &data.dY[N]);
-				if (fmtstatus < 4) {
-					MessagePopup ("Error", "Pasted data is in wrong format or it doesn't contain numbers.\nMake sure to copy a 4 column table.");
-					free (pastedstr);
-					return -1;
-				}
-				n = NumFmtdBytes ();
-				str += n;
+			// Parsed in place, in a single pass over the clipboard text.
+			DatasetFree (&data);
+			CloseDataBinary (&datamap);
+			status = ParseData (pastedstr, strlen (pastedstr), &data, &errline, &errcol);
+			free (pastedstr);
+			if (status == FIT_ERR_FORMAT) {
+				sprintf (msg, "Pasted data is in wrong format or it doesn't contain numbers (line %d, column %d).\nMake sure to copy a 4 column table.", errline, errcol);
+				MessagePopup ("Error", msg);
+				dataflag = 0;
+				return -1;
+			}
+			else if (status < 0) {
+				MessagePopup ("Error", FitStatusString (status));
+				dataflag = 0;
+				return -1;
 			}
 			
-			free (pastedstr);
 			SetCtrlVal (mainpanel, MAINPANEL_DATAINPUT, "Clipboard");
-			dataflag = 1;
-			fitflag = rangeflag = 0;
+			DataLoaded ();
 			break;
 	}
 	return 0;
@@ -285,12 +351,22 @@ int CVICALLBACK Fit (int panel, int control, int event,
 			
 			int i;
 			char fittypestr[100];
-			double w[N], err, inita[12];
-			initfit.a = inita;
+			double *w, *fity, err;
 			
 			// Change X range if FITRANGE is checked.
 			if (!rangeflag)
 				ChangeDataRange();
+			// At least as many points as parameters (POLY checks its degree below).
+			if (fitN < 1 || fitN < GetFitModel (fittype)->na) {
+				MessagePopup ("Error", "Not enough points in the fit range.\nChange the X range and try again.");
+				return -1;
+			}
+			// Weights and the initial fit's values at the fitted points, in one block.
+			if (!(w = malloc (2 * fitN * sizeof (double)))) {
+				MessagePopup ("Error", "Out of memory.");
+				return -1;
+			}
+			fity = w + fitN;
 			
 			// convert dY to weight for initial fit.
 			for (i = 0; i < fitN; i++)
@@ -300,7 +376,7 @@ int CVICALLBACK Fit (int panel, int control, int event,
 				case LIN:
 					fitfun = flin;
 					na = 2;
-					LinearFitEx (fitdata.X, fitdata.Y, w, fitN, LEAST_SQUARE, 0, initfit.fittedY, &initfit.a[1], &initfit.a[0], &err);
+					LinearFitEx (fitdata.X, fitdata.Y, w, fitN, LEAST_SQUARE, 0, fity, &initfit.a[1], &initfit.a[0], &err);
 					sprintf (fittypestr, "Linear fit\ny = a0 + a1 * x");
 					break;
 			
@@ -309,58 +385,76 @@ int CVICALLBACK Fit (int panel, int control, int event,
 					GetCtrlVal (mainpanel, MAINPANEL_POLYDEG, &na);
 					if (fitN < na) {
 						MessagePopup ("Error", "Number of data points must be greater than\nthe polynomial degree. Try again.");
+						free (w);
 						return -1;
 					}
 					na += 1;
-					PolyFitWithWeight (fitdata.X, fitdata.Y, w, fitN, na, NULL, NULL, 0, ALGORITHM_POLYFIT_SVD, initfit.fittedY, initfit.a, &err);
+					PolyFitWithWeight (fitdata.X, fitdata.Y, w, fitN, na, NULL, NULL, 0, ALGORITHM_POLYFIT_SVD, fity, initfit.a, &err);
 					sprintf (fittypestr, "Polynomial fit\ny = a0 + a1 * x + a2 * x^2...");
 					break;
 					
 				case EXP:
 					fitfun = fexp;
 					na = 2;
-					ExpFitEx (fitdata.X, fitdata.Y, w, fitN, LEAST_SQUARE, 0, initfit.fittedY, &initfit.a[0], &initfit.a[1], &err);
+					ExpFitEx (fitdata.X, fitdata.Y, w, fitN, LEAST_SQUARE, 0, fity, &initfit.a[0], &initfit.a[1], &err);
 					sprintf (fittypestr, "Exponential fit\ny = a0 * exp (a1 * x)");
 					break;
 					
 				case GAUSS:
 					fitfun = fgauss;
 					na = 3;
-					GaussFit (fitdata.X, fitdata.Y, w, fitN, LEAST_SQUARE, 0, NULL, initfit.fittedY, &initfit.a[0], &initfit.a[1], &initfit.a[2], &err);
+					GaussFit (fitdata.X, fitdata.Y, w, fitN, LEAST_SQUARE, 0, NULL, fity, &initfit.a[0], &initfit.a[1], &initfit.a[2], &err);
 					sprintf (fittypestr, "Gaussian fit\ny = a0 * exp ( - (x - a1)^2 / (2 * a2^2) )");
 					break;
 					
 				case LOG:
 					if (logerror) {
 						MessagePopup ("Error", "There are non-positive X values in the input data.\nUse different input data or change data range and try again.");
+						free (w);
 						return -1;
 					}
 					fitfun = flog;
 					na = 2;
-					LogFit (fitdata.X, fitdata.Y, w, fitN, 10, LEAST_SQUARE, 0, initfit.fittedY, &initfit.a[0], &initfit.a[1], &err);
+					LogFit (fitdata.X, fitdata.Y, w, fitN, 10, LEAST_SQUARE, 0, fity, &initfit.a[0], &initfit.a[1], &err);
 					sprintf (fittypestr, "Base 10 logarithm fit\ny = a0 * log (a1 * x)");
 					break;
 					
 				case LN:
 					if (logerror) {
 						MessagePopup ("Error", "There are non-positive X values in the input data. Use different input data or delete non-positive X points and try again.");
+						free (w);
 						return -1;
 					}
 					fitfun = fln;
 					na = 2;
-					LogFit (fitdata.X, fitdata.Y, w, fitN, EULER, LEAST_SQUARE, 0, initfit.fittedY, &initfit.a[0], &initfit.a[1], &err);
+					LogFit (fitdata.X, fitdata.Y, w, fitN, EULER, LEAST_SQUARE, 0, fity, &initfit.a[0], &initfit.a[1], &err);
 					sprintf (fittypestr, "Natural logarithm fit\ny = a0 * ln (a1 * x)");
 					break;
 			}
 			
-			fitpar = GeneralFit (fitfun, fitdata.X, fitdata.dX, fitdata.Xres, fitdata.Y, fitdata.dY, fitN, initfit.a, na);		
+			free (w);
+			fitpar = GeneralFit (fitfun, fitdata.X, fitdata.dX, fitdata.Y, fitdata.dY, fitN, initfit.a, na);		
+			
+			// Stuck: try again from many points around the initial guess.
+			if (fitpar.status == FIT_ERR_NOMIN) {
+				struct fitoptions opt;
+				
+				FitDefaultOptions (&opt);
+				opt.nstarts = NSTARTS;
+				fitpar = GeneralFitEx (fitfun, fitdata.X, fitdata.dX, fitdata.Y, fitdata.dY, fitN, initfit.a, na, &opt);
+			}
+			if (fitpar.status == FIT_ERR_NOMIN)
+				MessagePopup ("Error", "Can't minimize chi^2.\nTry different initial parameters.");
+			else if (fitpar.status < 0) {
+				MessagePopup ("Error", FitStatusString (fitpar.status));
+				return -1;
+			}
 			
 			// Calculate goodness of fit for initial fit. 
 			initfit.chisq = CalcChi2 (fitfun, fitdata.X, fitdata.dX, fitdata.Y, fitdata.dY, fitN, initfit.a, na);
 			XX_Dist (initfit.chisq, fitN - na, &initfit.pprob);
 			initfit.pprob = 1 - initfit.pprob;
 			initfit.rchisq = initfit.chisq / (fitN - na);
-			FEvalArray (fitfun, fitdata.Xres, initfit.fittedY, 5000, initfit.a, na);
 			
 			// Print fit parameters to FITPANEL.
 			char initastr[250] = "", fitparstr[250] = "", covstr[1000] = "", temp[200] = "";
@@ -384,8 +478,9 @@ int CVICALLBACK Fit (int panel, int control, int event,
 				}
 			}
 
-			sprintf (results, "%s\n\nIteration no. %d\nInitial parameters' values:\n%schi^2 = %f\nchi^2_red = %f\np_prob = %f\n\nFitted parameters' values:\n%s%schi^2 = %f\nndf = %d\nchi^2_red = %f\np_prob = %f",
-					fittypestr, fitpar.iter, initastr, initfit.chisq, initfit.rchisq, initfit.pprob,
+			sprintf (results, "%s\n\nIteration no. %d\nchi^2 evaluations: %lld, model evaluations: %lld\nFit time: %.3f s (errors %.3f s)\nInitial parameters' values:\n%schi^2 = %f\nchi^2_red = %f\np_prob = %f\n\nFitted parameters' values:\n%s%schi^2 = %f\nndf = %d\nchi^2_red = %f\np_prob = %f",
+					fittypestr, fitpar.iter, fitpar.stats.nchi2, fitpar.stats.neval, fitpar.stats.tfit,
+					fitpar.stats.thessian, initastr, initfit.chisq, initfit.rchisq, initfit.pprob,
 					fitparstr, covstr, fitpar.chisq, fitpar.ndf, fitpar.rchisq, fitpar.pprob);
 			ResetTextBox (fitpanel, FITPANEL_FITPARAMETERS, results);
 			fitflag = 1;
@@ -470,20 +565,16 @@ int CVICALLBACK PlotFit (int panel, int control, int event,
 	
 			switch (control) {
 				case MAINPANEL_PLOTFIT:
-					if (!fitplot) {
-						fitplot = PlotXY (graphpanel, GRAPHPANEL_GRAPH, fitdata.Xres, fitpar.fittedY, 5000,
-								VAL_DOUBLE, VAL_DOUBLE, VAL_THIN_LINE, VAL_NO_POINT, VAL_SOLID, 1, VAL_RED);
-					}
+					if (!fitplot)
+						fitplot = PlotCurve (fitpar.a, VAL_RED);
 					
 					SetMenuBarAttribute (graphmenu, GRAPHMENU_PLOTS_FITPLOT, ATTR_CHECKED, 1);
 					SetPlotAttribute (graphpanel, GRAPHPANEL_GRAPH, fitplot, ATTR_TRACE_VISIBLE, 1);
 					break;
 					
 				case MAINPANEL_PLOTINITFIT:
-					if (!initfitplot) {
-						initfitplot = PlotXY (graphpanel, GRAPHPANEL_GRAPH, fitdata.Xres, initfit.fittedY, 5000,
-								VAL_DOUBLE, VAL_DOUBLE, VAL_THIN_LINE, VAL_NO_POINT, VAL_SOLID, 1, VAL_GREEN);
-					}
+					if (!initfitplot)
+						initfitplot = PlotCurve (initfit.a, VAL_GREEN);
 					
 					SetMenuBarAttribute (graphmenu, GRAPHMENU_PLOTS_INITFITPLOT, ATTR_CHECKED, 1);
 					SetPlotAttribute (graphpanel, GRAPHPANEL_GRAPH, initfitplot, ATTR_TRACE_VISIBLE, 1);
@@ -509,27 +600,33 @@ int CVICALLBACK PlotResiduals (int panel, int control, int event,
 				return -1;
 			}
 	
-			int i, resplotX[N], resplotY[N], zero;
-			double resY[N];
+			int i, zero, xscaling, yscaling;
+			double *resY, xmin, xmax, ymin, ymax;
 			
 			if (!resplot) {
+				if (!(resY = malloc (N * sizeof (double)))) {
+					MessagePopup ("Error", "Out of memory.");
+					return -1;
+				}
 				GetTitles();
 				
-				// Calculate residuals and save in resY; Plot error bars and save in resplotX and resplotY.
+				// Calculate residuals and save in resY; Plot error bars.
+				FEvalArray (fitfun, data.X, resY, N, fitpar.a, na);
 				for (i = 0; i < N; i++) {
-					resY[i] = data.Y[i] - fitfun (data.X[i], fitpar.a, na);
+					resY[i] = data.Y[i] - resY[i];
 				
-					resplotY[i] = PlotLine (respanel, RESPANEL_GRAPH, data.X[i], resY[i] - data.dY[i],
-								data.X[i], resY[i] + data.dY[i], VAL_BLUE);
-					resplotX[i] = PlotLine (respanel, RESPANEL_GRAPH, data.X[i] - data.dX[i],
-								resY[i], data.X[i] + data.dX[i], resY[i], VAL_BLUE);
+					PlotLine (respanel, RESPANEL_GRAPH, data.X[i], resY[i] - data.dY[i],
+							  data.X[i], resY[i] + data.dY[i], VAL_BLUE);
+					PlotLine (respanel, RESPANEL_GRAPH, data.X[i] - data.dX[i],
+							  resY[i], data.X[i] + data.dX[i], resY[i], VAL_BLUE);
 				}
 				
 				// zero - baseline plot; resplot - data points.
-				zero = PlotLine (respanel, RESPANEL_GRAPH, fitdata.Xres[0], 0, fitdata.Xres[4999], 0,
-								 VAL_RED);
+				GetAxisRange (graphpanel, GRAPHPANEL_GRAPH, &xscaling, &xmin, &xmax, &yscaling, &ymin, &ymax);
+				zero = PlotLine (respanel, RESPANEL_GRAPH, xmin, 0, xmax, 0, VAL_RED);
 				resplot = PlotXY (respanel, RESPANEL_GRAPH, data.X, resY, N, VAL_DOUBLE, VAL_DOUBLE,
 								  VAL_SCATTER, VAL_SMALL_SOLID_SQUARE, VAL_SOLID, 1, VAL_BLUE);
+				free (resY);
 			}
 			
 			DisplayPanel (respanel);
@@ -613,6 +710,7 @@ int CVICALLBACK ChangeAxes (int panel, int control, int event,
 			GetCtrlVal (axespanel, AXESPANEL_YMIN, &ymin);	
 			GetCtrlVal (axespanel, AXESPANEL_YMAX, &ymax);
 			SetAxisRange (graphpanel, GRAPHPANEL_GRAPH, VAL_MANUAL, xmin, xmax, VAL_MANUAL, ymin, ymax);
+			ResampleCurves ();
 			RemovePopup (0);
 			break;
 	}
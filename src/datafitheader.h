@@ -22,36 +22,22 @@
 #include <cvirte.h>		
 #include "toolbox.h"
 
-#include "fitfunc.c"
+#include "curvifit.h"
 
 
 //==============================================================================
 // Constants
 
 
-		
+
 //==============================================================================
 // Types
 
-struct fitparameters {
-	int iter;
-	double *a;
-	double *aerr;
-	double *cov;
-	double chisq;
-	int ndf;
-	double rchisq;
-	double pprob;
-	double fittedY[5000];
-};
-		
+
 
 //==============================================================================
 // Global functions
 
-static struct fitparameters GeneralFit (double (*func)(double, double *, int), double X[], double dX[], double Xres[], double Y[], double dY[],
-								 int n, double inita[], int na);
-
 
 
 #endif  /* ndef __datafitheader_H__ */
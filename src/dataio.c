@@ -0,0 +1,568 @@
+//==============================================================================
+//
+// Title:		dataio.c
+// Purpose:		Reading of input data files into datasets. Files are mapped into
+//				memory and parsed in place, with no copy and no per line I/O.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Constants
+
+#define INITCAP		1024	// Initial capacity of a dataset.
+#define MAXDIGITS	19		// Max no. of significant digits that fit in a uint64_t.
+#define MAXTOKEN	128		// Max length of a number passed to strtod.
+
+// Binary dataset files (see WriteDataBinary): a 64 byte header followed by the columns,
+// each starting at a multiple of 64 bytes. All values are little endian.
+//	 0	magic "CVFITBIN"
+//	 8	uint32 version
+//	12	uint32 datacolumn flags of the columns stored as float32 (others are double)
+//	16	uint64 no. of points
+//	24	uint64 checksum of everything after the header (see Checksum)
+//	32	uint64 offsets of the X, dX, Y and dY columns from the start of the file
+#define BIN_MAGIC		"CVFITBIN"
+#define BIN_VERSION		1
+#define BIN_HEADER		64
+#define BIN_ALIGN		64
+
+//==============================================================================
+// Static functions
+
+// Powers of 10 exactly representable as doubles.
+static const double pow10tab[23] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses the number at the start of [p, end) into val, without needing a terminating '\0'.
+// Numbers of up to 15 significant digits and powers of 10 up to 1e22 (nearly all data) are
+// converted by one exact multiplication or division, which rounds correctly. Anything else
+// (more digits, large exponents, inf, nan, hex) is passed to strtod.
+// Returns the end of the number, or NULL if there's none.
+static const char *ParseNumber (const char *p, const char *end, double *val) {
+	const char *s = p, *q;
+	char token[MAXTOKEN];
+	uint64_t mant = 0;
+	int neg = 0, ndigits = 0, nsig = 0, exp10 = 0, e = 0, eneg = 0, edigits = 0;
+	double v;
+
+	if (s < end && (*s == '-' || *s == '+'))
+		neg = *s++ == '-';
+
+	for ( ; s < end && *s >= '0' && *s <= '9'; s++, ndigits++) {
+		if (nsig < MAXDIGITS) {
+			if (mant || *s != '0') {
+				mant = 10 * mant + (*s - '0');
+				nsig++;
+			}
+		}
+		else
+			exp10++;
+	}
+	if (s < end && *s == '.') {
+		for (s++; s < end && *s >= '0' && *s <= '9'; s++, ndigits++) {
+			if (nsig < MAXDIGITS) {
+				if (mant || *s != '0') {
+					mant = 10 * mant + (*s - '0');
+					nsig++;
+				}
+				exp10--;
+			}
+		}
+	}
+	if (!ndigits)
+		goto slow;
+
+	if (s < end && (*s == 'e' || *s == 'E')) {
+		q = s + 1;
+		if (q < end && (*q == '-' || *q == '+'))
+			eneg = *q++ == '-';
+		for ( ; q < end && *q >= '0' && *q <= '9'; q++, edigits++)
+			if (e < 10000)
+				e = 10 * e + (*q - '0');
+		if (edigits) {
+			exp10 += eneg ? -e : e;
+			s = q;
+		}
+	}
+
+	// A byte right after the number that strtod could still consume (e.g. "0x", "1.5.")
+	// leaves the decision to it.
+	if (s < end && (*s == 'x' || *s == 'X' || *s == '.'))
+		goto slow;
+
+	if (nsig <= 15 && exp10 >= -22 && exp10 <= 22) {
+		v = (double)mant;
+		v = exp10 < 0 ? v / pow10tab[-exp10] : v * pow10tab[exp10];
+		*val = neg ? -v : v;
+		return s;
+	}
+
+slow:
+	// strtod needs a terminated string: copy the token.
+	for (q = p; q < end && q - p < MAXTOKEN - 1 && *q != ' ' && *q != '\t' && *q != ','
+		 && *q != ';' && *q != '\r' && *q != '\n'; q++)
+		;
+	if (q == p)
+		return NULL;
+	memcpy (token, p, q - p);
+	token[q - p] = '\0';
+	*val = strtod (token, (char **)&q);
+	return q == token ? NULL : p + (q - token);
+}
+
+// Skips spaces, tabs and a '\r' of a CRLF line end.
+static const char *SkipBlanks (const char *p, const char *end) {
+
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
+}
+
+// Maps the whole file into memory, or reads it into a buffer if it can't be mapped.
+// *map is set to 1 for a mapping, 0 for a buffer to free.
+static int LoadFile (const char *path, char **buf, size_t *len, int *map) {
+#ifdef _WIN32
+	HANDLE f, h;
+	LARGE_INTEGER size;
+
+	f = CreateFileA (path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		return FIT_ERR_FILE;
+	if (!GetFileSizeEx (f, &size) || (uint64_t)size.QuadPart > SIZE_MAX) {
+		CloseHandle (f);
+		return FIT_ERR_FILE;
+	}
+	*len = (size_t)size.QuadPart;
+	*buf = NULL;
+	*map = 1;
+	if (*len) {
+		h = CreateFileMappingA (f, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (h) {
+			*buf = MapViewOfFile (h, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle (h);
+		}
+	}
+	CloseHandle (f);
+	if (*len && !*buf)
+		return FIT_ERR_FILE;
+	return FIT_OK;
+#else
+	struct stat st;
+	ssize_t got;
+	size_t done;
+	int fd;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return FIT_ERR_FILE;
+	if (fstat (fd, &st) < 0) {
+		close (fd);
+		return FIT_ERR_FILE;
+	}
+	*len = (size_t)st.st_size;
+	*buf = NULL;
+	*map = 1;
+	if (!*len) {
+		close (fd);
+		return FIT_OK;
+	}
+
+	*buf = mmap (NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*buf != MAP_FAILED) {
+		posix_madvise (*buf, *len, POSIX_MADV_SEQUENTIAL);
+		close (fd);
+		return FIT_OK;
+	}
+
+	// Not mappable (e.g. a pipe or a special file system): read it.
+	*map = 0;
+	if (!(*buf = malloc (*len))) {
+		close (fd);
+		return FIT_ERR_MEMORY;
+	}
+	for (done = 0; done < *len; done += got)
+		if ((got = read (fd, *buf + done, *len - done)) <= 0)
+			break;
+	close (fd);
+	if (done < *len) {
+		free (*buf);
+		return FIT_ERR_FILE;
+	}
+	return FIT_OK;
+#endif
+}
+
+// Fletcher style checksum of n 64 bit words: detects corrupted and truncated files
+// at memory speed.
+static uint64_t Checksum (const uint64_t *w, size_t n) {
+	uint64_t a = 1, b = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		a += w[i];
+		b += a;
+	}
+	return a ^ (b << 32 | b >> 32);
+}
+
+static void Put32 (unsigned char *p, uint32_t v) {
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = (unsigned char)(v >> 8 * i);
+}
+
+static void Put64 (unsigned char *p, uint64_t v) {
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (unsigned char)(v >> 8 * i);
+}
+
+static uint32_t Get32 (const unsigned char *p) {
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t Get64 (const unsigned char *p) {
+	return Get32 (p) | (uint64_t)Get32 (p + 4) << 32;
+}
+
+// Column data is used in place, so it must already be in the host's byte order.
+static int LittleEndian (void) {
+	const uint16_t one = 1;
+
+	return *(const unsigned char *)&one == 1;
+}
+
+static void UnloadFile (char *buf, size_t len, int map) {
+
+	if (!map)
+		free (buf);
+	else if (buf) {
+#ifdef _WIN32
+		UnmapViewOfFile (buf);
+#else
+		munmap (buf, len);
+#endif
+	}
+}
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Makes room for at least cap points in data, keeping its points.
+/// HIFN  The four columns share one block of memory (X is its start), so a dataset
+/// HIFN  costs a single allocation however large it grows.
+/// HIRET FIT_OK or FIT_ERR_MEMORY.
+
+int DatasetReserve (struct dataset *data, int cap) {
+	double *p;
+
+	if (cap <= data->cap)
+		return FIT_OK;
+	if (cap > INT_MAX / 4 || !(p = malloc (4 * (size_t)cap * sizeof (double))))
+		return FIT_ERR_MEMORY;
+
+	if (data->n) {
+		memcpy (p, data->X, data->n * sizeof (double));
+		memcpy (p + cap, data->dX, data->n * sizeof (double));
+		memcpy (p + 2 * (size_t)cap, data->Y, data->n * sizeof (double));
+		memcpy (p + 3 * (size_t)cap, data->dY, data->n * sizeof (double));
+	}
+	if (data->cap)
+		free (data->X);
+
+	data->X = p;
+	data->dX = p + cap;
+	data->Y = p + 2 * (size_t)cap;
+	data->dY = p + 3 * (size_t)cap;
+	data->cap = cap;
+
+	return FIT_OK;
+}
+
+// Adds a point at the end of data, doubling its capacity when full.
+int DatasetAppend (struct dataset *data, double x, double dx, double y, double dy) {
+	int status;
+
+	if (data->n == data->cap) {
+		if (data->cap > INT_MAX / 2)
+			return FIT_ERR_MEMORY;
+		if ((status = DatasetReserve (data, data->cap ? 2 * data->cap : INITCAP)) < 0)
+			return status;
+	}
+
+	data->X[data->n] = x;
+	data->dX[data->n] = dx;
+	data->Y[data->n] = y;
+	data->dY[data->n] = dy;
+	data->n++;
+
+	return FIT_OK;
+}
+
+// Frees the arrays of data and empties it. Views (cap 0, see OpenDataBinary) are only emptied.
+void DatasetFree (struct dataset *data) {
+
+	if (data->cap)
+		free (data->X);
+	memset (data, 0, sizeof (*data));
+}
+
+/// HIFN  Parses a 4 column table (X, dX, Y, dY) from the len bytes of buf into data.
+/// HIFN  buf needn't be terminated. Columns are separated by spaces or tabs, optionally
+/// HIFN  around a single comma or semicolon, as in CSV files; the separator can change from
+/// HIFN  row to row. Empty lines are skipped and anything after the 4th column is ignored.
+/// HIFN  data must be empty or previously filled by this function.
+/// HIPAR errline/Receives the line no. of a bad row on FIT_ERR_FORMAT. May be NULL.
+/// HIPAR errcol/Receives the column (1 based, in bytes) where that row went wrong. May be NULL.
+/// HIRET FIT_OK, FIT_ERR_FORMAT or FIT_ERR_MEMORY.
+
+int ParseData (const char *buf, size_t len, struct dataset *data, int *errline, int *errcol) {
+	const char *p = buf, *end = buf + len, *eol, *line, *q;
+	double col[4];
+	size_t nlines = 1;
+	int i, status, line_no;
+
+	// One point per line at most: reserve them all at once.
+	for (eol = buf; (eol = memchr (eol, '\n', end - eol)); eol++)
+		nlines++;
+	data->n = 0;
+	if ((status = DatasetReserve (data, nlines < INT_MAX ? (int)nlines : INT_MAX)) < 0)
+		return status;
+
+	for (line_no = 1; p < end; line_no++) {
+		if (!(eol = memchr (p, '\n', end - p)))
+			eol = end;
+		line = p;
+
+		p = SkipBlanks (p, eol);
+		if (p < eol) {
+			for (i = 0; i < 4; i++) {
+				if (i) {
+					p = SkipBlanks (p, eol);
+					if (p < eol && (*p == ',' || *p == ';'))
+						p = SkipBlanks (p + 1, eol);
+				}
+				if (!(q = ParseNumber (p, eol, &col[i]))) {
+					if (errline)
+						*errline = line_no;
+					if (errcol)
+						*errcol = (int)(p - line) + 1;
+					return FIT_ERR_FORMAT;
+				}
+				p = q;
+			}
+			if ((status = DatasetAppend (data, col[0], col[1], col[2], col[3])) < 0)
+				return status;
+		}
+
+		p = eol + (eol < end);
+	}
+
+	return FIT_OK;
+}
+
+/// HIFN  Reads a 4 column table (X, dX, Y, dY) from a text file into data, see ParseData.
+/// HIFN  The file is mapped into memory rather than read, when possible.
+/// HIPAR errline/Receives the line no. of a bad row on FIT_ERR_FORMAT. May be NULL.
+/// HIPAR errcol/Receives the column of the error in that row. May be NULL.
+/// HIRET FIT_OK, FIT_ERR_FILE, FIT_ERR_FORMAT or FIT_ERR_MEMORY.
+
+int ReadDataFile (const char *path, struct dataset *data, int *errline, int *errcol) {
+	char *buf;
+	size_t len;
+	int map, status;
+
+	if ((status = LoadFile (path, &buf, &len, &map)) < 0)
+		return status;
+	status = ParseData (buf, len, data, errline, errcol);
+	UnloadFile (buf, len, map);
+
+	return status;
+}
+
+// Copies the points of data with xmin <= X <= xmax to out (an empty dataset).
+int SelectDataRange (const struct dataset *data, double xmin, double xmax, struct dataset *out) {
+	int i, status;
+
+	for (i = 0; i < data->n; i++) {
+		if (data->X[i] >= xmin && data->X[i] <= xmax) {
+			status = DatasetAppend (out, data->X[i], data->dX[i], data->Y[i], data->dY[i]);
+			if (status < 0)
+				return status;
+		}
+	}
+
+	return FIT_OK;
+}
+
+/// HIFN  Checks whether path is a binary dataset file (see WriteDataBinary).
+/// HIRET 1 if it is, 0 if it isn't or can't be read.
+
+int DataFileIsBinary (const char *path) {
+	char magic[8];
+	FILE *f;
+	int isbin;
+
+	if (!(f = fopen (path, "rb")))
+		return 0;
+	isbin = fread (magic, 1, 8, f) == 8 && !memcmp (magic, BIN_MAGIC, 8);
+	fclose (f);
+
+	return isbin;
+}
+
+/// HIFN  Writes data to a binary dataset file, which OpenDataBinary loads without parsing
+/// HIFN  or copying. Columns are stored as doubles, or as floats (half the size, 7 significant
+/// HIFN  digits) if their datacolumn flag is in f32cols, e.g. DATA_DX | DATA_DY.
+/// HIRET FIT_OK, FIT_ERR_FILE, FIT_ERR_MEMORY or FIT_ERR_ARGS (big endian host).
+
+int WriteDataBinary (const char *path, const struct dataset *data, int f32cols) {
+	const double *cols[4] = {data->X, data->dX, data->Y, data->dY};
+	unsigned char header[BIN_HEADER] = {0};
+	size_t i, size[4], nw, off = BIN_HEADER;
+	uint64_t sum, *w;
+	float *f;
+	int k, n = data->n, status = FIT_OK;
+	FILE *fp;
+
+	if (!LittleEndian ())
+		return FIT_ERR_ARGS;
+
+	// The whole payload is built in memory for the checksum, then written at once.
+	for (k = 0; k < 4; k++) {
+		size[k] = (size_t)n * (f32cols & 1 << k ? sizeof (float) : sizeof (double));
+		Put64 (header + 32 + 8 * k, off);
+		off += (size[k] + BIN_ALIGN - 1) / BIN_ALIGN * BIN_ALIGN;
+	}
+	nw = (off - BIN_HEADER) / 8;
+	if (!(w = calloc (nw ? nw : 1, 8)))
+		return FIT_ERR_MEMORY;
+	for (k = 0; k < 4; k++) {
+		unsigned char *dst = (unsigned char *)w + Get64 (header + 32 + 8 * k) - BIN_HEADER;
+
+		if (f32cols & 1 << k)
+			for (i = 0, f = (float *)dst; i < (size_t)n; i++)
+				f[i] = (float)cols[k][i];
+		else if (n)
+			memcpy (dst, cols[k], size[k]);
+	}
+	sum = Checksum (w, nw);
+
+	memcpy (header, BIN_MAGIC, 8);
+	Put32 (header + 8, BIN_VERSION);
+	Put32 (header + 12, f32cols & (DATA_X | DATA_DX | DATA_Y | DATA_DY));
+	Put64 (header + 16, n);
+	Put64 (header + 24, sum);
+
+	if (!(fp = fopen (path, "wb")))
+		status = FIT_ERR_FILE;
+	else {
+		if (fwrite (header, 1, BIN_HEADER, fp) != BIN_HEADER || fwrite (w, 8, nw, fp) != nw)
+			status = FIT_ERR_FILE;
+		if (fclose (fp) != 0)
+			status = FIT_ERR_FILE;
+	}
+	free (w);
+
+	return status;
+}
+
+/// HIFN  Opens a binary dataset file written by WriteDataBinary. The file is mapped into
+/// HIFN  memory and dm->data is a read only view of its double columns, to be passed to
+/// HIFN  FitWorkspaceInit or SelectDataRange as is; float columns are converted to doubles.
+/// HIFN  The view is valid until CloseDataBinary (DatasetFree on it does nothing).
+/// HIRET FIT_OK, FIT_ERR_FILE, FIT_ERR_FORMAT (not a binary dataset, or corrupted) or FIT_ERR_MEMORY.
+
+int OpenDataBinary (const char *path, struct datamap *dm) {
+	double **cols[4], *conv;
+	const unsigned char *h;
+	uint64_t n, off, size;
+	int k, f32cols, nconv = 0, status;
+	size_t i;
+
+	memset (dm, 0, sizeof (*dm));
+	cols[0] = &dm->data.X;
+	cols[1] = &dm->data.dX;
+	cols[2] = &dm->data.Y;
+	cols[3] = &dm->data.dY;
+	if ((status = LoadFile (path, &dm->buf, &dm->len, &dm->mapped)) < 0)
+		return status;
+
+	h = (const unsigned char *)dm->buf;
+	status = FIT_ERR_FORMAT;
+	if (!LittleEndian () || dm->len < BIN_HEADER || dm->len % 8 || memcmp (h, BIN_MAGIC, 8)
+		|| Get32 (h + 8) != BIN_VERSION || (f32cols = (int)Get32 (h + 12)) > 15
+		|| (n = Get64 (h + 16)) > INT_MAX)
+		goto fail;
+
+	for (k = 0; k < 4; k++) {
+		off = Get64 (h + 32 + 8 * k);
+		size = n * (f32cols & 1 << k ? sizeof (float) : sizeof (double));
+		if (off < BIN_HEADER || off % 8 || off > dm->len || size > dm->len - off)
+			goto fail;
+		nconv += (f32cols >> k) & 1;
+	}
+	if (Checksum ((const uint64_t *)(dm->buf + BIN_HEADER), (dm->len - BIN_HEADER) / 8) != Get64 (h + 24))
+		goto fail;
+
+	if (nconv && n && !(dm->conv = malloc (nconv * (size_t)n * sizeof (double)))) {
+		status = FIT_ERR_MEMORY;
+		goto fail;
+	}
+	conv = dm->conv;
+	for (k = 0; k < 4; k++) {
+		off = Get64 (h + 32 + 8 * k);
+		if (f32cols & 1 << k) {
+			const float *f = (const float *)(dm->buf + off);
+
+			for (i = 0; i < n; i++)
+				conv[i] = f[i];
+			*cols[k] = conv;
+			conv += n;
+		}
+		else
+			*cols[k] = (double *)(dm->buf + off);
+	}
+	dm->data.n = (int)n;
+
+	return FIT_OK;
+
+fail:
+	CloseDataBinary (dm);
+	return status;
+}
+
+// Unmaps a file opened by OpenDataBinary and frees its converted columns.
+void CloseDataBinary (struct datamap *dm) {
+
+	UnloadFile (dm->buf, dm->len, dm->mapped);
+	free (dm->conv);
+	memset (dm, 0, sizeof (*dm));
+}
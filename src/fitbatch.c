@@ -0,0 +1,132 @@
+//==============================================================================
+//
+// Title:		fitbatch.c
+// Purpose:		Fitting of many curves to the same model at once (e.g. spectra
+//				on a common X grid), spread over all CPUs.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <string.h>
+
+#include "curvifit.h"
+#include "fitthread.h"
+
+
+//==============================================================================
+// Constants
+
+#define BATCHCHUNK	16		// No. of curves fitted by a task, with one workspace.
+
+//==============================================================================
+// Types
+
+// A FitBatch call, shared by its tasks.
+struct batchjob {
+	const struct fitmodel *model;
+	int na;
+	const struct fitbatch *b;
+	struct fitoptions opt;
+	struct fitworkspace shared;		// Bound to the common X and dX, with their features, if n > 0.
+	struct fitparameters *results;
+};
+
+//==============================================================================
+// Static functions
+
+// Fits curves i * BATCHCHUNK ... of the batch, with one workspace.
+static void BatchTask (void *arg, int i) {
+	struct batchjob *job = arg;
+	const struct fitbatch *b = job->b;
+	struct fitparameters *fit;
+	struct fitworkspace ws = {0};
+	double a[MAXPAR], *X, *dX, *Y, *dY, tguess;
+	int k, k1 = (i + 1) * BATCHCHUNK, status;
+
+	if (k1 > b->ncurves)
+		k1 = b->ncurves;
+
+	for (k = i * BATCHCHUNK; k < k1; k++) {
+		fit = &job->results[k];
+		X = b->X + (size_t)k * b->xstride;
+		dX = b->dX + (size_t)k * b->dxstride;
+		Y = b->Y + (size_t)k * b->ystride;
+		dY = b->dY + (size_t)k * b->dystride;
+
+		status = FitWorkspaceInit (&ws, X, dX, Y, dY, b->n);
+		if (status >= 0 && job->shared.n)
+			status = FitWorkspaceShare (&ws, &job->shared);
+		tguess = 0;
+		if (status >= 0 && b->inita)
+			memcpy (a, b->inita + (size_t)k * b->initstride, job->na * sizeof (double));
+		else if (status >= 0) {
+			tguess = FitClock ();
+			status = InitialGuess (job->model->type, X, Y, dY, b->n, a, job->na);
+			tguess = FitClock () - tguess;
+		}
+		if (status < 0) {
+			memset (fit, 0, sizeof (*fit));
+			fit->na = job->na;
+			fit->status = status;
+			continue;
+		}
+		*fit = GeneralFitWs (job->model, &ws, a, job->na, &job->opt);
+		fit->stats.tguess = tguess;
+	}
+
+	FitWorkspaceFree (&ws);
+}
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Fits every curve of b to model, on up to opt->nthreads threads. Each fit starts
+/// HIFN  from its b->inita, or else from InitialGuess, as a separate GeneralFitWs would
+/// HIFN  (models other than the built-in ones need inita). Curves sharing X and dX
+/// HIFN  (xstride and dxstride 0) share the x dependent data of the model too.
+/// HIPAR na/No. of parameters (the model's, or the polynomial degree + 1 for POLY).
+/// HIPAR opt/Fit options, see FitDefaultOptions. NULL for the defaults. warm and trace are ignored.
+/// HIPAR results/Receives the b->ncurves fits; each has its own status.
+/// HIRET FIT_OK, FIT_ERR_ARGS or FIT_ERR_MEMORY.
+
+int FitBatch (const struct fitmodel *model, int na, const struct fitbatch *b, const struct fitoptions *opt,
+			  struct fitparameters results[]) {
+	struct batchjob job;
+	int status;
+
+	if (!model || na < 1 || na > MAXPAR || (model->na && na != model->na) || b->ncurves < 0 || b->n < na
+		|| b->xstride < 0 || b->dxstride < 0 || b->ystride < 0 || b->dystride < 0 || b->initstride < 0
+		|| (!b->inita && GetFitModel (model->type) != model))
+		return FIT_ERR_ARGS;
+
+	memset (&job, 0, sizeof (job));
+	job.model = model;
+	job.na = na;
+	job.b = b;
+	job.results = results;
+	if (opt)
+		job.opt = *opt;
+	else
+		FitDefaultOptions (&job.opt);
+	job.opt.warm = NULL;
+	job.opt.trace = NULL;			// One trace can't record concurrent fits.
+
+	// The features of a common grid are computed here, once for all curves (Y isn't used).
+	if (model->features && !b->xstride && !b->dxstride) {
+		if ((status = FitWorkspaceInit (&job.shared, b->X, b->dX, b->Y, b->dY, b->n)) < 0
+			|| (status = FitWorkspaceFeatures (&job.shared, model->features)) < 0) {
+			FitWorkspaceFree (&job.shared);
+			return status;
+		}
+	}
+
+	FitParallelFor (job.opt.nthreads, (b->ncurves + BATCHCHUNK - 1) / BATCHCHUNK, BatchTask, &job);
+	FitWorkspaceFree (&job.shared);
+
+	return FIT_OK;
+}
@@ -0,0 +1,188 @@
+//==============================================================================
+//
+// Title:		fitdual.h
+// Purpose:		Dual numbers for forward mode automatic differentiation of the
+//				fit functions: a model written with these operations (see
+//				fitmodel.dual) yields its value and its exact derivatives by
+//				every parameter in a single evaluation.
+//
+//				A dual number carries a value v and the derivatives d[j] of v
+//				by the parameters a_j, j < na. The parameters are passed in
+//				with d[j] = 1 for their own j and 0 for the others, constants
+//				and x with all d[j] = 0 (DualConst).
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+#ifndef __fitdual_H__
+#define __fitdual_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+
+//==============================================================================
+// Include files
+
+#include <math.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Constants
+
+// The operations are inlined so that loops over data points using them vectorize.
+#if defined(__GNUC__)
+	#define DUAL_INLINE		static inline __attribute__ ((always_inline))
+#else
+	#define DUAL_INLINE		static inline
+#endif
+
+//==============================================================================
+// Types
+
+struct dual {
+	double v;
+	double d[MAXPAR];
+};
+
+
+//==============================================================================
+// Static functions
+
+// Only the first na derivatives of a dual number are used; the others are zeroed here so that it's
+// never copied uninitialized.
+DUAL_INLINE struct dual DualConst (double c, int na) {
+	struct dual r;
+	int j;
+
+	(void)na;
+	r.v = c;
+	for (j = 0; j < MAXPAR; j++)
+		r.d[j] = 0;
+	return r;
+}
+
+// u + c and u * c for a constant c.
+DUAL_INLINE struct dual DualAddC (struct dual u, double c) {
+
+	u.v += c;
+	return u;
+}
+
+DUAL_INLINE struct dual DualMulC (struct dual u, double c, int na) {
+	int j;
+
+	u.v *= c;
+	for (j = 0; j < na; j++)
+		u.d[j] *= c;
+	return u;
+}
+
+DUAL_INLINE struct dual DualAdd (struct dual u, struct dual w, int na) {
+	int j;
+
+	u.v += w.v;
+	for (j = 0; j < na; j++)
+		u.d[j] += w.d[j];
+	return u;
+}
+
+DUAL_INLINE struct dual DualSub (struct dual u, struct dual w, int na) {
+	int j;
+
+	u.v -= w.v;
+	for (j = 0; j < na; j++)
+		u.d[j] -= w.d[j];
+	return u;
+}
+
+DUAL_INLINE struct dual DualMul (struct dual u, struct dual w, int na) {
+	int j;
+
+	for (j = 0; j < na; j++)
+		u.d[j] = u.d[j] * w.v + u.v * w.d[j];
+	u.v *= w.v;
+	return u;
+}
+
+DUAL_INLINE struct dual DualDiv (struct dual u, struct dual w, int na) {
+	double q = u.v / w.v;
+	int j;
+
+	for (j = 0; j < na; j++)
+		u.d[j] = (u.d[j] - q * w.d[j]) / w.v;
+	u.v = q;
+	return u;
+}
+
+// f (u) for a function f of derivative df at u.v.
+DUAL_INLINE struct dual DualChain (struct dual u, double f, double df, int na) {
+
+	u = DualMulC (u, df, na);
+	u.v = f;
+	return u;
+}
+
+DUAL_INLINE struct dual DualExp (struct dual u, int na) {
+	double e = exp (u.v);
+
+	return DualChain (u, e, e, na);
+}
+
+DUAL_INLINE struct dual DualLog (struct dual u, int na) {
+
+	return DualChain (u, log (u.v), 1 / u.v, na);
+}
+
+DUAL_INLINE struct dual DualLog10 (struct dual u, int na) {
+
+	return DualChain (u, log10 (u.v), 0.43429448190325182765 / u.v, na);
+}
+
+DUAL_INLINE struct dual DualSqrt (struct dual u, int na) {
+	double s = sqrt (u.v);
+
+	return DualChain (u, s, 0.5 / s, na);
+}
+
+DUAL_INLINE struct dual DualPow (struct dual u, double p, int na) {
+
+	return DualChain (u, pow (u.v, p), p * pow (u.v, p - 1), na);
+}
+
+DUAL_INLINE struct dual DualSin (struct dual u, int na) {
+
+	return DualChain (u, sin (u.v), cos (u.v), na);
+}
+
+DUAL_INLINE struct dual DualCos (struct dual u, int na) {
+
+	return DualChain (u, cos (u.v), -sin (u.v), na);
+}
+
+// Sigma of a data point with x errors, sqrt (dy^2 + fdx^2), where fdx is df/dx dx, or (f(x+dx) - f(x-dx)) / 2
+// for models without a slope kernel (see CalcChi2). Without x errors it's DualConst (dy, na). The derivative
+// is fdx / s times that of fdx; s is computed by hypot, so that it's right (about +-1) where fdx^2 overflows.
+DUAL_INLINE struct dual DualSigma (struct dual fdx, double dy, int na) {
+	double s = hypot (dy, fdx.v);
+
+	return DualChain (fdx, s, fdx.v / s, na);
+}
+
+// Weighted residual (y - f) / s of a data point.
+DUAL_INLINE struct dual DualResidual (struct dual f, struct dual s, double y, int na) {
+
+	return DualDiv (DualAddC (DualMulC (f, -1, na), y), s, na);
+}
+
+
+#ifdef __cplusplus
+	}
+#endif
+
+#endif  /* ndef __fitdual_H__ */
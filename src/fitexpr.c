@@ -0,0 +1,871 @@
+//==============================================================================
+//
+// Title:		fitexpr.c
+// Purpose:		Models given as formulas at run time, e.g.
+//				"a0 * exp (-a1 * x) + a2". A formula is parsed once into an
+//				expression graph (constants folded, equal subexpressions
+//				stored once), differentiated by x and its parameters in the
+//				same graph, and compiled to programs that evaluate a block of
+//				points per instruction, so that every instruction is one
+//				vectorized loop.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curvifit.h"
+#include "fitsimd.h"
+
+
+//==============================================================================
+// Constants
+
+#define EXPR_MAXNODES	1024		// Nodes of a formula and its derivatives.
+#define EXPR_MAXREGS	32			// Point registers of a program, X included.
+#define EXPR_MAXDEPTH	100			// Max nesting of a formula.
+#define EXPR_MAXNAME	16			// Max length of a name in a formula.
+#define EXPR_BLOCK		64			// Points run through a program at once: its registers stay in the L1 cache.
+#define EXPR_PI			3.14159265358979323846
+#define EXPR_E			2.71828182845904523536
+#define EXPR_LN10		2.30258509299404568402
+
+// Operations of the graph and the programs: leaves, unary operations, then binary ones.
+enum exprop {
+	EXPR_CONST, EXPR_X, EXPR_PARAM,
+	EXPR_NEG, EXPR_EXP, EXPR_LN, EXPR_LOG10, EXPR_SQRT, EXPR_ABS, EXPR_SIN, EXPR_COS, EXPR_TAN, EXPR_ATAN,
+	EXPR_SINH, EXPR_COSH, EXPR_TANH,
+	EXPR_ADD, EXPR_SUB, EXPR_MUL, EXPR_DIV, EXPR_POW
+};
+
+// Operands of a point instruction: both point registers, or the left or right one a uniform slot.
+enum exprmode {EXPR_PP, EXPR_PU, EXPR_UP};
+
+//==============================================================================
+// Types
+
+// Node of the expression graph. Equal nodes are stored once, so a node may have several users;
+// operands always come before their users.
+struct exprnode {
+	int op;
+	int l, r;						// Operands, -1 for none.
+	double c;						// Value of EXPR_CONST, parameter no. of EXPR_PARAM.
+	int varies;						// 1 if it depends on x, 0 if it's uniform (the same for all points).
+};
+
+// Graph being built, and the state of the parser.
+struct exprgraph {
+	const char *p;					// Next character of the formula.
+	int depth;
+	int status;						// FIT_OK, or the first error.
+	const char *errpos;
+	int used[MAXPAR];				// 1 for the parameters in the formula.
+	int n;
+	struct exprnode nodes[EXPR_MAXNODES];
+};
+
+// dst = op (l, r), on uniform slots or on the points of a block. l of EXPR_PARAM is the parameter no.
+struct exprins {
+	short op;
+	short mode;
+	short dst;
+	short l;
+	short r;
+};
+
+// Program computing some nodes of a graph: its uniform instructions are run once per call, then its
+// point instructions on every block of points. Point register 0 is X.
+struct exprprog {
+	int nuni;						// No. of uniform slots...
+	double *uinit;					// ...and their values before the uniform instructions (the constants).
+	int nuins;
+	struct exprins *uins;
+	int npins;
+	struct exprins *pins;
+	int nout;
+	int out[2 + 2 * MAXPAR];		// Register or slot of each output...
+	int outvaries[2 + 2 * MAXPAR];	// ...1 for a register.
+};
+
+//==============================================================================
+// Static functions
+
+static int ParseSum (struct exprgraph *g);
+
+// op (l, r) on single values: for uniform instructions and constant folding.
+static double ScalarOp (int op, double l, double r) {
+
+	switch (op) {
+		case EXPR_NEG:		return -l;
+		case EXPR_EXP:		return exp (l);
+		case EXPR_LN:		return log (l);
+		case EXPR_LOG10:	return log10 (l);
+		case EXPR_SQRT:		return sqrt (l);
+		case EXPR_ABS:		return fabs (l);
+		case EXPR_SIN:		return sin (l);
+		case EXPR_COS:		return cos (l);
+		case EXPR_TAN:		return tan (l);
+		case EXPR_ATAN:		return atan (l);
+		case EXPR_SINH:		return sinh (l);
+		case EXPR_COSH:		return cosh (l);
+		case EXPR_TANH:		return tanh (l);
+		case EXPR_ADD:		return l + r;
+		case EXPR_SUB:		return l - r;
+		case EXPR_MUL:		return l * r;
+		case EXPR_DIV:		return l / r;
+		case EXPR_POW:		return pow (l, r);
+	}
+	return NAN;
+}
+
+//==============================================================================
+// Expression graph
+
+// Records the first error of the formula, at the current position.
+static int Fail (struct exprgraph *g, int status) {
+
+	if (g->status == FIT_OK) {
+		g->status = status;
+		g->errpos = g->p;
+	}
+	return -1;
+}
+
+static int IsConst (const struct exprgraph *g, int k, double c) {
+
+	return g->nodes[k].op == EXPR_CONST && g->nodes[k].c == c;
+}
+
+// Returns the node op (l, r), simplified: constant operands are folded, operations by 0 and 1
+// dropped, small integer and half powers turned into products and roots, and an equal node
+// already in the graph is reused. -1 on error (operand -1 or the graph full).
+static int Node (struct exprgraph *g, int op, int l, int r, double c) {
+	struct exprnode *nd;
+	int k;
+
+	if ((op > EXPR_PARAM && l < 0) || (op >= EXPR_ADD && r < 0))
+		return -1;
+
+	if (op > EXPR_PARAM && g->nodes[l].op == EXPR_CONST && (op < EXPR_ADD || g->nodes[r].op == EXPR_CONST))
+		return Node (g, EXPR_CONST, -1, -1, ScalarOp (op, g->nodes[l].c, op < EXPR_ADD ? 0 : g->nodes[r].c));
+
+	switch (op) {
+		case EXPR_NEG:
+			if (g->nodes[l].op == EXPR_NEG)
+				return g->nodes[l].l;
+			break;
+		case EXPR_ADD:
+			if (IsConst (g, l, 0))
+				return r;
+			if (IsConst (g, r, 0))
+				return l;
+			if (g->nodes[r].op == EXPR_NEG)
+				return Node (g, EXPR_SUB, l, g->nodes[r].l, 0);
+			if (g->nodes[l].op == EXPR_NEG)
+				return Node (g, EXPR_SUB, r, g->nodes[l].l, 0);
+			break;
+		case EXPR_SUB:
+			if (IsConst (g, r, 0))
+				return l;
+			if (IsConst (g, l, 0))
+				return Node (g, EXPR_NEG, r, -1, 0);
+			if (l == r)
+				return Node (g, EXPR_CONST, -1, -1, 0);
+			if (g->nodes[r].op == EXPR_NEG)
+				return Node (g, EXPR_ADD, l, g->nodes[r].l, 0);
+			break;
+		case EXPR_MUL:
+			if (IsConst (g, l, 0) || IsConst (g, r, 0))
+				return Node (g, EXPR_CONST, -1, -1, 0);
+			if (IsConst (g, l, 1))
+				return r;
+			if (IsConst (g, r, 1))
+				return l;
+			if (IsConst (g, l, -1))
+				return Node (g, EXPR_NEG, r, -1, 0);
+			if (IsConst (g, r, -1))
+				return Node (g, EXPR_NEG, l, -1, 0);
+			break;
+		case EXPR_DIV:
+			if (IsConst (g, r, 1))
+				return l;
+			if (IsConst (g, l, 0))
+				return l;
+			break;
+		case EXPR_POW:
+			if (IsConst (g, r, 0))
+				return Node (g, EXPR_CONST, -1, -1, 1);
+			if (IsConst (g, r, 1))
+				return l;
+			if (IsConst (g, r, 2))
+				return Node (g, EXPR_MUL, l, l, 0);
+			if (IsConst (g, r, 3))
+				return Node (g, EXPR_MUL, Node (g, EXPR_MUL, l, l, 0), l, 0);
+			if (IsConst (g, r, 0.5))
+				return Node (g, EXPR_SQRT, l, -1, 0);
+			if (IsConst (g, r, -1))
+				return Node (g, EXPR_DIV, Node (g, EXPR_CONST, -1, -1, 1), l, 0);
+			if (IsConst (g, r, -2))
+				return Node (g, EXPR_DIV, Node (g, EXPR_CONST, -1, -1, 1), Node (g, EXPR_MUL, l, l, 0), 0);
+			break;
+	}
+
+	// Commutative operations in one order, so that a + b and b + a are the same node.
+	if ((op == EXPR_ADD || op == EXPR_MUL) && l > r) {
+		k = l;
+		l = r;
+		r = k;
+	}
+
+	for (k = 0; k < g->n; k++) {
+		nd = &g->nodes[k];
+		if (nd->op == op && nd->l == l && nd->r == r && (nd->c == c || (isnan (nd->c) && isnan (c))))
+			return k;
+	}
+
+	if (g->n == EXPR_MAXNODES)
+		return Fail (g, FIT_ERR_ARGS);
+	nd = &g->nodes[g->n];
+	nd->op = op;
+	nd->l = op > EXPR_PARAM ? l : -1;
+	nd->r = op >= EXPR_ADD ? r : -1;
+	nd->c = c;
+	nd->varies = op == EXPR_X || (nd->l >= 0 && g->nodes[l].varies) || (nd->r >= 0 && g->nodes[r].varies);
+	return g->n++;
+}
+
+static int Const (struct exprgraph *g, double c) {
+
+	return Node (g, EXPR_CONST, -1, -1, c);
+}
+
+// Derivative of node k by parameter j, or by x for j = -1, added to the graph. memo[k] is the
+// derivative of node k once it's built, -1 before.
+static int Diff (struct exprgraph *g, int k, int j, int memo[]) {
+	const struct exprnode *nd = &g->nodes[k];
+	int l = nd->l, r = nd->r, dl = -1, dr = -1, d;
+
+	if (memo[k] >= 0)
+		return memo[k];
+	if (l >= 0)
+		dl = Diff (g, l, j, memo);
+	if (r >= 0)
+		dr = Diff (g, r, j, memo);
+
+	switch (nd->op) {
+		case EXPR_X:		d = Const (g, j < 0); break;
+		case EXPR_PARAM:	d = Const (g, (int)nd->c == j); break;
+		case EXPR_NEG:		d = Node (g, EXPR_NEG, dl, -1, 0); break;
+		case EXPR_EXP:		d = Node (g, EXPR_MUL, k, dl, 0); break;
+		case EXPR_LN:		d = Node (g, EXPR_DIV, dl, l, 0); break;
+		case EXPR_LOG10:	d = Node (g, EXPR_DIV, dl, Node (g, EXPR_MUL, Const (g, EXPR_LN10), l, 0), 0); break;
+		case EXPR_SQRT:		d = Node (g, EXPR_DIV, dl, Node (g, EXPR_MUL, Const (g, 2), k, 0), 0); break;
+		case EXPR_ABS:		d = Node (g, EXPR_MUL, dl, Node (g, EXPR_DIV, l, k, 0), 0); break;
+		case EXPR_SIN:		d = Node (g, EXPR_MUL, Node (g, EXPR_COS, l, -1, 0), dl, 0); break;
+		case EXPR_COS:		d = Node (g, EXPR_NEG, Node (g, EXPR_MUL, Node (g, EXPR_SIN, l, -1, 0), dl, 0), -1, 0); break;
+		case EXPR_TAN:		d = Node (g, EXPR_MUL, Node (g, EXPR_ADD, Const (g, 1), Node (g, EXPR_MUL, k, k, 0), 0), dl, 0); break;
+		case EXPR_ATAN:		d = Node (g, EXPR_DIV, dl, Node (g, EXPR_ADD, Const (g, 1), Node (g, EXPR_MUL, l, l, 0), 0), 0); break;
+		case EXPR_SINH:		d = Node (g, EXPR_MUL, Node (g, EXPR_COSH, l, -1, 0), dl, 0); break;
+		case EXPR_COSH:		d = Node (g, EXPR_MUL, Node (g, EXPR_SINH, l, -1, 0), dl, 0); break;
+		case EXPR_TANH:		d = Node (g, EXPR_MUL, Node (g, EXPR_SUB, Const (g, 1), Node (g, EXPR_MUL, k, k, 0), 0), dl, 0); break;
+		case EXPR_ADD:		d = Node (g, EXPR_ADD, dl, dr, 0); break;
+		case EXPR_SUB:		d = Node (g, EXPR_SUB, dl, dr, 0); break;
+		case EXPR_MUL:
+			d = Node (g, EXPR_ADD, Node (g, EXPR_MUL, dl, r, 0), Node (g, EXPR_MUL, l, dr, 0), 0);
+			break;
+		// (dl - (l / r) dr) / r, reusing l / r.
+		case EXPR_DIV:
+			d = Node (g, EXPR_DIV, Node (g, EXPR_SUB, dl, Node (g, EXPR_MUL, k, dr, 0), 0), r, 0);
+			break;
+		// c l^(c-1) dl for a constant power, else l^r (dr ln l + r dl / l).
+		case EXPR_POW:
+			if (g->nodes[r].op == EXPR_CONST)
+				d = Node (g, EXPR_MUL, Node (g, EXPR_MUL, r, Node (g, EXPR_POW, l, Const (g, g->nodes[r].c - 1), 0), 0),
+						  dl, 0);
+			else
+				d = Node (g, EXPR_MUL, k, Node (g, EXPR_ADD, Node (g, EXPR_MUL, dr, Node (g, EXPR_LN, l, -1, 0), 0),
+											   Node (g, EXPR_DIV, Node (g, EXPR_MUL, r, dl, 0), l, 0), 0), 0);
+			break;
+		default:			d = Const (g, 0); break;
+	}
+
+	return memo[k] = d;
+}
+
+//==============================================================================
+// Parser
+
+static void SkipSpace (struct exprgraph *g) {
+
+	while (isspace ((unsigned char)*g->p))
+		g->p++;
+}
+
+// Number, x, parameter (a0, a1...), pi, e, function (argument) or (sum).
+static int ParsePrimary (struct exprgraph *g) {
+	static const struct {const char *name; int op;} funcs[] = {
+		{"exp", EXPR_EXP}, {"ln", EXPR_LN}, {"log", EXPR_LOG10}, {"log10", EXPR_LOG10}, {"sqrt", EXPR_SQRT},
+		{"abs", EXPR_ABS}, {"sin", EXPR_SIN}, {"cos", EXPR_COS}, {"tan", EXPR_TAN}, {"atan", EXPR_ATAN},
+		{"sinh", EXPR_SINH}, {"cosh", EXPR_COSH}, {"tanh", EXPR_TANH}
+	};
+	const char *start;
+	char name[EXPR_MAXNAME], *end;
+	double v;
+	int i, k, len;
+
+	SkipSpace (g);
+	start = g->p;
+
+	if (isdigit ((unsigned char)*g->p) || *g->p == '.') {
+		v = strtod (g->p, &end);
+		if (end == g->p)
+			return Fail (g, FIT_ERR_FORMAT);
+		g->p = end;
+		return Const (g, v);
+	}
+
+	if (*g->p == '(') {
+		g->p++;
+		k = ParseSum (g);
+		SkipSpace (g);
+		if (*g->p != ')')
+			return Fail (g, FIT_ERR_FORMAT);
+		g->p++;
+		return k;
+	}
+
+	if (!isalpha ((unsigned char)*g->p) && *g->p != '_')
+		return Fail (g, FIT_ERR_FORMAT);
+	for (len = 0; isalnum ((unsigned char)g->p[len]) || g->p[len] == '_'; len++)
+		;
+	if (len >= EXPR_MAXNAME)
+		return Fail (g, FIT_ERR_FORMAT);
+	memcpy (name, g->p, len);
+	name[len] = 0;
+	g->p += len;
+
+	if (!strcmp (name, "x"))
+		return Node (g, EXPR_X, -1, -1, 0);
+	if (!strcmp (name, "pi"))
+		return Const (g, EXPR_PI);
+	if (!strcmp (name, "e"))
+		return Const (g, EXPR_E);
+	if (name[0] == 'a' && len > 1 && strspn (name + 1, "0123456789") == (size_t)len - 1) {
+		k = atoi (name + 1);
+		if (k >= MAXPAR || (name[1] == '0' && len > 2)) {
+			g->p = start;
+			return Fail (g, FIT_ERR_FORMAT);
+		}
+		g->used[k] = 1;
+		return Node (g, EXPR_PARAM, -1, -1, k);
+	}
+
+	for (i = 0; i < (int)(sizeof (funcs) / sizeof (funcs[0])); i++)
+		if (!strcmp (name, funcs[i].name)) {
+			SkipSpace (g);
+			if (*g->p != '(')
+				return Fail (g, FIT_ERR_FORMAT);
+			g->p++;
+			k = ParseSum (g);
+			SkipSpace (g);
+			if (*g->p != ')')
+				return Fail (g, FIT_ERR_FORMAT);
+			g->p++;
+			return Node (g, funcs[i].op, k, -1, 0);
+		}
+
+	g->p = start;
+	return Fail (g, FIT_ERR_FORMAT);
+}
+
+// Signed power: -x^2 is -(x^2), and powers are right associative (a^b^c = a^(b^c)).
+static int ParseUnary (struct exprgraph *g) {
+	int k;
+
+	SkipSpace (g);
+	if (++g->depth > EXPR_MAXDEPTH)
+		return Fail (g, FIT_ERR_ARGS);
+
+	if (*g->p == '-') {
+		g->p++;
+		k = Node (g, EXPR_NEG, ParseUnary (g), -1, 0);
+	}
+	else if (*g->p == '+') {
+		g->p++;
+		k = ParseUnary (g);
+	}
+	else {
+		k = ParsePrimary (g);
+		SkipSpace (g);
+		if (*g->p == '^' || (g->p[0] == '*' && g->p[1] == '*')) {
+			g->p += *g->p == '^' ? 1 : 2;
+			k = Node (g, EXPR_POW, k, ParseUnary (g), 0);
+		}
+	}
+
+	g->depth--;
+	return k;
+}
+
+static int ParseProduct (struct exprgraph *g) {
+	int k = ParseUnary (g), op;
+
+	for (SkipSpace (g); *g->p == '*' || *g->p == '/'; SkipSpace (g)) {
+		op = *g->p++ == '*' ? EXPR_MUL : EXPR_DIV;
+		k = Node (g, op, k, ParseUnary (g), 0);
+	}
+	return k;
+}
+
+static int ParseSum (struct exprgraph *g) {
+	int k = ParseProduct (g), op;
+
+	for (SkipSpace (g); *g->p == '+' || *g->p == '-'; SkipSpace (g)) {
+		op = *g->p++ == '+' ? EXPR_ADD : EXPR_SUB;
+		k = Node (g, op, k, ParseProduct (g), 0);
+	}
+	return k;
+}
+
+//==============================================================================
+// Programs
+
+// Compiles the nodes roots of g, and those they depend on, to a program with an output per root.
+// Nodes that don't vary are computed once per call into uniform slots, the others into point
+// registers, each freed after its last use. NULL with *status set on error.
+static struct exprprog *Compile (const struct exprgraph *g, const int roots[], int nroots, int *status) {
+	struct exprprog *p;
+	struct exprins uins[EXPR_MAXNODES], pins[EXPR_MAXNODES], *in;
+	double uinit[EXPR_MAXNODES];
+	int live[EXPR_MAXNODES], last[EXPR_MAXNODES], loc[EXPR_MAXNODES], regfree[EXPR_MAXREGS];
+	int i, k, r, nuni = 0, nuins = 0, npins = 0;
+	const struct exprnode *nd;
+
+	// Live nodes, and the last instruction using each one. Outputs are used to the end.
+	memset (live, 0, g->n * sizeof (int));
+	for (k = 0; k < nroots; k++)
+		live[roots[k]] = 1;
+	for (i = g->n - 1; i >= 0; i--)
+		if (live[i]) {
+			last[i] = -1;
+			if (g->nodes[i].l >= 0)
+				live[g->nodes[i].l] = 1;
+			if (g->nodes[i].r >= 0)
+				live[g->nodes[i].r] = 1;
+		}
+	for (i = 0; i < g->n; i++)
+		if (live[i]) {
+			if (g->nodes[i].l >= 0)
+				last[g->nodes[i].l] = i;
+			if (g->nodes[i].r >= 0)
+				last[g->nodes[i].r] = i;
+		}
+	for (k = 0; k < nroots; k++)
+		last[roots[k]] = g->n;
+
+	regfree[0] = 0;
+	for (r = 1; r < EXPR_MAXREGS; r++)
+		regfree[r] = 1;
+
+	for (i = 0; i < g->n; i++) {
+		if (!live[i])
+			continue;
+		nd = &g->nodes[i];
+
+		if (!nd->varies) {
+			loc[i] = nuni;
+			uinit[nuni] = nd->op == EXPR_CONST ? nd->c : 0;
+			if (nd->op != EXPR_CONST) {
+				in = &uins[nuins++];
+				in->op = nd->op;
+				in->mode = EXPR_PP;
+				in->dst = nuni;
+				in->l = nd->op == EXPR_PARAM ? (int)nd->c : loc[nd->l];
+				in->r = nd->r >= 0 ? loc[nd->r] : 0;
+			}
+			nuni++;
+			continue;
+		}
+
+		if (nd->op == EXPR_X) {
+			loc[i] = 0;
+			continue;
+		}
+
+		// A new register, so that dst never overlaps the operands.
+		for (r = 1; r < EXPR_MAXREGS && !regfree[r]; r++)
+			;
+		if (r == EXPR_MAXREGS) {
+			*status = FIT_ERR_ARGS;
+			return NULL;
+		}
+		regfree[r] = 0;
+		loc[i] = r;
+
+		in = &pins[npins++];
+		in->op = nd->op;
+		in->dst = r;
+		in->l = loc[nd->l];
+		in->r = nd->r >= 0 ? loc[nd->r] : 0;
+		if (nd->op < EXPR_ADD || g->nodes[nd->r].varies)
+			in->mode = (nd->op < EXPR_ADD || g->nodes[nd->l].varies) ? EXPR_PP : EXPR_UP;
+		else
+			in->mode = EXPR_PU;
+
+		if (nd->l >= 0 && g->nodes[nd->l].varies && last[nd->l] == i)
+			regfree[loc[nd->l]] = loc[nd->l] != 0;
+		if (nd->r >= 0 && g->nodes[nd->r].varies && last[nd->r] == i)
+			regfree[loc[nd->r]] = loc[nd->r] != 0;
+	}
+
+	p = malloc (sizeof (*p) + nuni * sizeof (double) + (nuins + npins) * sizeof (struct exprins));
+	if (!p) {
+		*status = FIT_ERR_MEMORY;
+		return NULL;
+	}
+	p->nuni = nuni;
+	p->uinit = (double *)(p + 1);
+	p->nuins = nuins;
+	p->uins = (struct exprins *)(p->uinit + nuni);
+	p->npins = npins;
+	p->pins = p->uins + nuins;
+	memcpy (p->uinit, uinit, nuni * sizeof (double));
+	memcpy (p->uins, uins, nuins * sizeof (struct exprins));
+	memcpy (p->pins, pins, npins * sizeof (struct exprins));
+	p->nout = nroots;
+	for (k = 0; k < nroots; k++) {
+		p->out[k] = loc[roots[k]];
+		p->outvaries[k] = g->nodes[roots[k]].varies;
+	}
+	return p;
+}
+
+// Fills the uniform slots u of p for the parameters a.
+static void RunUniform (const struct exprprog *p, const double a[], double u[]) {
+	const struct exprins *in;
+	int k;
+
+	memcpy (u, p->uinit, p->nuni * sizeof (double));
+	for (k = 0; k < p->nuins; k++) {
+		in = &p->uins[k];
+		u[in->dst] = in->op == EXPR_PARAM ? a[in->l] : ScalarOp (in->op, u[in->l], u[in->r]);
+	}
+}
+
+#define EXPR_NEGF(v)		(-(v))
+#define EXPR_ADDF(v, w)		((v) + (w))
+#define EXPR_SUBF(v, w)		((v) - (w))
+#define EXPR_MULF(v, w)		((v) * (w))
+#define EXPR_DIVF(v, w)		((v) / (w))
+
+#define EXPR_UNARY(F)																					\
+	for (i = 0; i < len; i++)																			\
+		d[i] = F (l[i])
+
+#define EXPR_BINARY(F)																					\
+	if (in->mode == EXPR_PP)																			\
+		for (i = 0; i < len; i++)																		\
+			d[i] = F (l[i], r[i]);																		\
+	else if (in->mode == EXPR_PU)																		\
+		for (i = 0; i < len; i++)																		\
+			d[i] = F (l[i], ur);																		\
+	else																								\
+		for (i = 0; i < len; i++)																		\
+			d[i] = F (ul, r[i])
+
+// Runs the point instructions of p on the len <= EXPR_BLOCK points of X, with the uniform slots u,
+// and copies output k to out[k].
+SIMD_CLONES static void RunPoints (const struct exprprog *p, const double u[], const double X[], int len,
+								   double *out[]) {
+	double reg[EXPR_MAXREGS][EXPR_BLOCK], *d, ul = 0, ur = 0;
+	const double *l = X, *r = X;
+	const struct exprins *in;
+	int i, k;
+
+	for (k = 0; k < p->npins; k++) {
+		in = &p->pins[k];
+		d = reg[in->dst];
+		if (in->mode == EXPR_UP)
+			ul = u[in->l];
+		else
+			l = in->l ? reg[in->l] : X;
+		if (in->mode == EXPR_PU)
+			ur = u[in->r];
+		else
+			r = in->r ? reg[in->r] : X;
+
+		switch (in->op) {
+			case EXPR_NEG:		EXPR_UNARY (EXPR_NEGF); break;
+			case EXPR_SQRT:		EXPR_UNARY (sqrt); break;
+			case EXPR_ABS:		EXPR_UNARY (fabs); break;
+			case EXPR_SIN:		EXPR_UNARY (sin); break;
+			case EXPR_COS:		EXPR_UNARY (cos); break;
+			case EXPR_TAN:		EXPR_UNARY (tan); break;
+			case EXPR_ATAN:		EXPR_UNARY (atan); break;
+			case EXPR_SINH:		EXPR_UNARY (sinh); break;
+			case EXPR_COSH:		EXPR_UNARY (cosh); break;
+			case EXPR_TANH:		EXPR_UNARY (tanh); break;
+			case EXPR_ADD:		EXPR_BINARY (EXPR_ADDF); break;
+			case EXPR_SUB:		EXPR_BINARY (EXPR_SUBF); break;
+			case EXPR_MUL:		EXPR_BINARY (EXPR_MULF); break;
+			case EXPR_DIV:		EXPR_BINARY (EXPR_DIVF); break;
+			case EXPR_POW:		EXPR_BINARY (pow); break;
+			// The vector exp and log, and the C library's outside their range.
+			case EXPR_EXP:
+				EXPR_UNARY (VecExp);
+				for (i = 0; i < len; i++)
+					if (!ExpInRange (l[i]))
+						d[i] = exp (l[i]);
+				break;
+			case EXPR_LN:
+				EXPR_UNARY (VecLog);
+				for (i = 0; i < len; i++)
+					if (!LogInRange (l[i]))
+						d[i] = log (l[i]);
+				break;
+			case EXPR_LOG10:
+				EXPR_UNARY (VecLog10);
+				for (i = 0; i < len; i++)
+					if (!LogInRange (l[i]))
+						d[i] = log10 (l[i]);
+				break;
+		}
+	}
+
+	for (k = 0; k < p->nout; k++)
+		if (p->outvaries[k])
+			memcpy (out[k], p->out[k] ? reg[p->out[k]] : X, len * sizeof (double));
+		else
+			for (i = 0; i < len; i++)
+				out[k][i] = u[p->out[k]];
+}
+
+//==============================================================================
+// Model kernels
+
+// Array kernel of a formula.
+static void ExprArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	const struct exprprog *p = ((const struct fitexpr *)m->data)->value;
+	double u[p->nuni + 1], *out;
+	int i0;
+
+	(void)na;
+	RunUniform (p, a, u);
+	for (i0 = 0; i0 < n; i0 += EXPR_BLOCK) {
+		out = Y + i0;
+		RunPoints (p, u, X + i0, n - i0 < EXPR_BLOCK ? n - i0 : EXPR_BLOCK, &out);
+	}
+}
+
+// Slope kernel of a formula.
+static void ExprSlope (const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na) {
+	const struct exprprog *p = ((const struct fitexpr *)m->data)->slope;
+	double u[p->nuni + 1], *out[2];
+	int i0;
+
+	(void)na;
+	RunUniform (p, a, u);
+	for (i0 = 0; i0 < n; i0 += EXPR_BLOCK) {
+		out[0] = Y + i0;
+		out[1] = D + i0;
+		RunPoints (p, u, X + i0, n - i0 < EXPR_BLOCK ? n - i0 : EXPR_BLOCK, out);
+	}
+}
+
+// Jacobian kernel of a formula, from the program computing it with its derivatives. The residuals and
+// sigmas are those of ResidualBlock: sigma^2 = dy^2 + fdx^2 with fdx = df/dx dx, or ( f(x+dx) - f(x-dx) ) / 2
+// for formulas without a slope program, so dr / da = - ( df / da + r dsigma / da ) / sigma and
+// dsigma / da = fdx / sigma * dfdx / da.
+static void ExprJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						  double a[], int na, double r[], double s[], double *J[]) {
+	const struct fitexpr *e = m->data;
+	const struct exprprog *p = ws->hasdx && e->gradslope ? e->gradslope : e->grad;
+	double *X = ws->X + i0, *dX = ws->dX + i0, *Y = ws->Y + i0, *dY = ws->dY + i0;
+	double f[2 + 2 * MAXPAR][EXPR_BLOCK], fu[1 + MAXPAR][EXPR_BLOCK], fd[1 + MAXPAR][EXPR_BLOCK];
+	double *fo[2 + 2 * MAXPAR], *fuo[1 + MAXPAR], *fdo[1 + MAXPAR], xs[EXPR_BLOCK], t[EXPR_BLOCK];
+	double u[p->nuni + 1], fdx;
+	int b, i, j, k, bl;
+
+	RunUniform (p, a, u);
+	for (k = 0; k < p->nout; k++)
+		fo[k] = f[k];
+	for (k = 0; k <= na; k++) {
+		fuo[k] = fu[k];
+		fdo[k] = fd[k];
+	}
+
+	for (b = 0; b < len; b += EXPR_BLOCK) {
+		bl = len - b < EXPR_BLOCK ? len - b : EXPR_BLOCK;
+		RunPoints (p, u, X + b, bl, fo);
+
+		if (!ws->hasdx) {
+			for (i = 0; i < bl; i++) {
+				s[b + i] = dY[b + i];
+				r[b + i] = (Y[b + i] - f[0][i]) / s[b + i];
+			}
+			for (j = 0; j < na; j++)
+				for (i = 0; i < bl; i++)
+					J[j][b + i] = -f[1 + j][i] / s[b + i];
+			continue;
+		}
+
+		// f, df/da, df/dx and d(df/dx)/da: dfdx / da = d(df/dx)/da dx.
+		if (p == e->gradslope) {
+			for (i = 0; i < bl; i++) {
+				fdx = f[1 + na][i] * dX[b + i];
+				s[b + i] = sqrt (dY[b + i] * dY[b + i] + fdx * fdx);
+				r[b + i] = (Y[b + i] - f[0][i]) / s[b + i];
+				t[i] = r[b + i] * fdx / s[b + i] * dX[b + i];
+			}
+			for (j = 0; j < na; j++)
+				for (i = 0; i < bl; i++)
+					J[j][b + i] = -(f[1 + j][i] + t[i] * f[2 + na + j][i]) / s[b + i];
+			continue;
+		}
+
+		for (i = 0; i < bl; i++)
+			xs[i] = X[b + i] + dX[b + i];
+		RunPoints (p, u, xs, bl, fuo);
+		for (i = 0; i < bl; i++)
+			xs[i] = X[b + i] - dX[b + i];
+		RunPoints (p, u, xs, bl, fdo);
+
+		for (i = 0; i < bl; i++) {
+			fdx = (fu[0][i] - fd[0][i]) / 2;
+			s[b + i] = sqrt (dY[b + i] * dY[b + i] + fdx * fdx);
+			r[b + i] = (Y[b + i] - f[0][i]) / s[b + i];
+			t[i] = r[b + i] * fdx / s[b + i];
+		}
+		for (j = 0; j < na; j++)
+			for (i = 0; i < bl; i++)
+				J[j][b + i] = -(f[1 + j][i] + t[i] * (fu[1 + j][i] - fd[1 + j][i]) / 2) / s[b + i];
+	}
+}
+
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Compiles a formula in x and the parameters a0, a1... to a model, e.g. "a0 * exp (-a1 * x) + a2"
+/// HIFN  (a leading "y =" is allowed). Formulas have + - * / ^ (or **), parentheses, numbers, pi, e and
+/// HIFN  the functions exp, ln, log (base 10, as the LOG model), log10, sqrt, abs, sin, cos, tan, atan,
+/// HIFN  sinh, cosh and tanh. The model, e->model, has na = 1 + the highest parameter no. and exact
+/// HIFN  derivatives; InitialGuess doesn't know it, so fits start from the caller's parameters.
+/// HIPAR e/Receives the model. Free it with FitExprFree, even on error.
+/// HIPAR errcol/Receives the column (1 based, in bytes) of a syntax error. May be NULL.
+/// HIRET FIT_OK, FIT_ERR_FORMAT (syntax error), FIT_ERR_ARGS (a parameter missing below the highest,
+/// HIRET none at all, or the formula too large) or FIT_ERR_MEMORY.
+
+int FitExprInit (struct fitexpr *e, const char *formula, int *errcol) {
+	struct exprgraph *g;
+	int roots[2 + 2 * MAXPAR], memo[EXPR_MAXNODES], j, na, status = FIT_OK;
+	const char *body;
+
+	memset (e, 0, sizeof (*e));
+	if (!formula)
+		return FIT_ERR_ARGS;
+	if (!(g = malloc (sizeof (*g))))
+		return FIT_ERR_MEMORY;
+	memset (g, 0, offsetof (struct exprgraph, nodes));
+
+	// An optional "y =" before the formula.
+	g->p = formula;
+	SkipSpace (g);
+	if (*g->p == 'y') {
+		g->p++;
+		SkipSpace (g);
+		if (*g->p == '=')
+			g->p++;
+		else
+			g->p = formula;
+	}
+	SkipSpace (g);
+	body = g->p;
+
+	roots[0] = ParseSum (g);
+	SkipSpace (g);
+	if (*g->p)
+		Fail (g, FIT_ERR_FORMAT);
+	if (g->status < 0) {
+		if (errcol && g->status == FIT_ERR_FORMAT)
+			*errcol = (int)(g->errpos - formula) + 1;
+		status = g->status;
+	}
+
+	for (na = MAXPAR; na > 0 && !g->used[na - 1]; na--)
+		;
+	for (j = 0; j < na && status == FIT_OK; j++)
+		if (!g->used[j])
+			status = FIT_ERR_ARGS;
+	if (status == FIT_OK && !na)
+		status = FIT_ERR_ARGS;
+
+	for (j = 0; j < na && status == FIT_OK; j++) {
+		memset (memo, -1, sizeof (memo));
+		roots[1 + j] = Diff (g, roots[0], j, memo);
+		status = g->status;
+	}
+
+	if (status == FIT_OK && (e->value = Compile (g, roots, 1, &status)))
+		e->grad = Compile (g, roots, 1 + na, &status);
+
+	// df/dx and its derivatives, after the others so that they don't change the programs above. A
+	// formula too large for them still fits, with its x errors taken through f (x +- dx).
+	if (status == FIT_OK) {
+		memset (memo, -1, sizeof (memo));
+		roots[1 + na] = Diff (g, roots[0], -1, memo);
+		for (j = 0; j < na && g->status == FIT_OK; j++) {
+			memset (memo, -1, sizeof (memo));
+			roots[2 + na + j] = Diff (g, roots[1 + na], j, memo);
+		}
+		if (g->status == FIT_OK && (e->gradslope = Compile (g, roots, 2 + 2 * na, &status))) {
+			roots[1] = roots[1 + na];
+			e->slope = Compile (g, roots, 2, &status);
+		}
+		if (!e->slope && status != FIT_ERR_MEMORY) {
+			free (e->gradslope);
+			e->gradslope = NULL;
+			status = FIT_OK;
+		}
+	}
+	free (g);
+	if (status == FIT_OK && !(e->text = malloc (strlen (body) + 5)))
+		status = FIT_ERR_MEMORY;
+	if (status < 0) {
+		FitExprFree (e);
+		return status;
+	}
+
+	sprintf (e->text, "y = %s", body);
+	e->model.type = -1;
+	e->model.name = "expr";
+	e->model.desc = "User defined fit";
+	e->model.formula = e->text;
+	e->model.na = na;
+	e->model.funcarray = ExprArray;
+	e->model.jacobian = ExprJacobian;
+	e->model.slope = e->slope ? ExprSlope : NULL;
+	e->model.data = e;
+	return FIT_OK;
+}
+
+/// HIFN  Frees a model compiled by FitExprInit.
+
+void FitExprFree (struct fitexpr *e) {
+
+	free (e->value);
+	free (e->slope);
+	free (e->grad);
+	free (e->gradslope);
+	free (e->text);
+	memset (e, 0, sizeof (*e));
+}
@@ -1,37 +1,101 @@
-#include <ansi_c.h>
 //==============================================================================
 //
 // Title:		fitfunc.c
-// Purpose:		A short description of the implementation.
+// Purpose:		Fit functions, their array kernels and the table of available
+//				models.
 //
 // Created by: Shaked Tuval, 2021
 // License:    MIT License (see LICENSE file)
 //
 //==============================================================================
 
+//==============================================================================
+// Include files
+
+#include <math.h>
+#include <string.h>
+
+#include "curvifit.h"
+#include "fitdual.h"
+#include "fitsimd.h"
+
+
+//==============================================================================
+// Static functions
+
+static void flinArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+static void fexpArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+static void fpolyArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+static void fgaussArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+static void flogArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+static void flnArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na);
+static void flinResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						   double a[], int na, double r[], double s[]);
+static void fexpResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						   double a[], int na, double r[], double s[]);
+static void fpolyResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+							double a[], int na, double r[], double s[]);
+static void fgaussResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+							 double a[], int na, double r[], double s[]);
+static void flogResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						   double a[], int na, double r[], double s[]);
+static void flnResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						  double a[], int na, double r[], double s[]);
+static struct dual flinDual (double x, const struct dual *a, int na);
+static struct dual fexpDual (double x, const struct dual *a, int na);
+static struct dual fpolyDual (double x, const struct dual *a, int na);
+static struct dual fgaussDual (double x, const struct dual *a, int na);
+static struct dual flogDual (double x, const struct dual *a, int na);
+static struct dual flnDual (double x, const struct dual *a, int na);
+static void flinSlope (const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na);
+static void fexpSlope (const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na);
+static void fpolySlope (const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na);
+static void fgaussSlope (const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na);
+static void flogSlope (const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na);
+static void flnSlope (const struct fitmodel *m, double X[], double Y[], double D[], int n, double a[], int na);
+static void flinJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						  double a[], int na, double r[], double s[], double *J[]);
+static void fexpJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						  double a[], int na, double r[], double s[], double *J[]);
+static void fpolyJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						   double a[], int na, double r[], double s[], double *J[]);
+static void fgaussJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+							double a[], int na, double r[], double s[], double *J[]);
+static void flogJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						  double a[], int na, double r[], double s[], double *J[]);
+static void flnJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						 double a[], int na, double r[], double s[], double *J[]);
+
+
+//==============================================================================
+// Static global variables
 
-static double flin (double x, double a[], int na);
-static double fexp (double x, double a[], int na);
-static double fpoly (double x, double a[], int na);
-static double fgauss (double x, double a[], int na);
-static double flog (double x, double a[], int na);
-static double fln (double x, double a[], int na);
+static const struct fitmodel models[NFITTYPES] = {
+	{LIN,	"lin",		"Linear fit",				"y = a0 + a1 * x",								2,	flin,	flinArray,	flinResiduals,	0,	1,	flinDual,	flinJacobian,	flinSlope,	NULL},
+	{EXP,	"exp",		"Exponential fit",			"y = a0 * exp (a1 * x)",						2,	fexp,	fexpArray,	fexpResiduals,	0,	0,	fexpDual,	fexpJacobian,	fexpSlope,	NULL},
+	{POLY,	"poly",		"Polynomial fit",			"y = a0 + a1 * x + a2 * x^2...",				0,	fpoly,	fpolyArray,	fpolyResiduals,	0,	1,	fpolyDual,	fpolyJacobian,	fpolySlope,	NULL},
+	{GAUSS,	"gauss",	"Gaussian fit",				"y = a0 * exp ( - (x - a1)^2 / (2 * a2^2) )",	3,	fgauss,	fgaussArray,	fgaussResiduals,	0,	0,	fgaussDual,	fgaussJacobian,	fgaussSlope,	NULL},
+	{LOG,	"log",		"Base 10 logarithm fit",	"y = a0 * log (a1 * x)",						2,	flog,	flogArray,	flogResiduals,	FIT_FEAT_LOGX,	0,	flogDual,	flogJacobian,	flogSlope,	NULL},
+	{LN,	"ln",		"Natural logarithm fit",	"y = a0 * ln (a1 * x)",							2,	fln,	flnArray,	flnResiduals,	FIT_FEAT_LOGX,	0,	flnDual,	flnJacobian,	flnSlope,	NULL}
+};
 
 
 //==============================================================================
 
 
-static double flin (double x, double a[], int na) {
+double flin (double x, double a[], int na) {
 	
+	(void)na;
 	return a[0] + a[1] * x;
 }
 
-static double fexp (double x, double a[], int na) {
+double fexp (double x, double a[], int na) {
 	
+	(void)na;
 	return a[0] * exp (a[1] * x);
 }
 
-static double fpoly (double x, double a[], int na) {
+double fpoly (double x, double a[], int na) {
 	double y = 0;
 	int i;
 	
@@ -41,17 +105,547 @@ static double fpoly (double x, double a[], int na) {
 	return y;
 }
 
-static double fgauss (double x, double a[], int na) {
+double fgauss (double x, double a[], int na) {
 	
+	(void)na;
 	return a[0] * exp ( - (x - a[1]) * (x - a[1]) / (2 * a[2] * a[2]) );
 }
 
-static double flog (double x, double a[], int na) {
+double flog (double x, double a[], int na) {
 	
+	(void)na;
 	return a[0] * log10 (a[1] * x);
 }
 
-static double fln (double x, double a[], int na) {
+double fln (double x, double a[], int na) {
 	
+	(void)na;
 	return a[0] * log (a[1] * x);
 }
+
+//==============================================================================
+// The fit functions in dual numbers (see fitdual.h), for their exact Jacobian. The
+// expressions are shared with the Jacobian kernels below, which pass the vector exp and
+// log as EXPF and LOGF.
+
+#define LIN_DUAL(x, c, na, EXPF)		DualAdd ((c)[0], DualMulC ((c)[1], (x), (na)), (na))
+#define EXP_DUAL(x, c, na, EXPF)		DualMul ((c)[0], EXPF (DualMulC ((c)[1], (x), (na)), (na)), (na))
+#define GAUSS_DUAL(x, c, na, EXPF)		DualMul ((c)[0], EXPF (GaussArgDual ((x), (c), (na)), (na)), (na))
+#define LOG_DUAL(x, c, na, LOGF)		DualMul ((c)[0], LOGF (DualMulC ((c)[1], (x), (na)), (na)), (na))
+
+// - (x - a1)^2 / (2 a2^2).
+DUAL_INLINE struct dual GaussArgDual (double x, const struct dual *a, int na) {
+	struct dual t = DualAddC (DualMulC (a[1], -1, na), x);
+
+	return DualDiv (DualMul (t, t, na), DualMulC (DualMul (a[2], a[2], na), -2, na), na);
+}
+
+DUAL_INLINE struct dual PolySlopeDual (double x, const struct dual *a, int na) {
+	struct dual y = DualMulC (a[na - 1], na - 1, na);
+	int k;
+
+	for (k = na - 2; k >= 1; k--)
+		y = DualAdd (DualMulC (y, x, na), DualMulC (a[k], k, na), na);
+
+	return y;
+}
+
+DUAL_INLINE struct dual PolyHornerDual (double x, const struct dual *a, int na) {
+	struct dual y = a[na - 1];
+	int k;
+
+	for (k = na - 2; k >= 0; k--)
+		y = DualAdd (DualMulC (y, x, na), a[k], na);
+
+	return y;
+}
+
+static struct dual flinDual (double x, const struct dual *a, int na) {
+
+	return LIN_DUAL (x, a, na, DualExp);
+}
+
+static struct dual fexpDual (double x, const struct dual *a, int na) {
+
+	return EXP_DUAL (x, a, na, DualExp);
+}
+
+static struct dual fpolyDual (double x, const struct dual *a, int na) {
+
+	return PolyHornerDual (x, a, na);
+}
+
+static struct dual fgaussDual (double x, const struct dual *a, int na) {
+
+	return GAUSS_DUAL (x, a, na, DualExp);
+}
+
+static struct dual flogDual (double x, const struct dual *a, int na) {
+
+	return LOG_DUAL (x, a, na, DualLog10);
+}
+
+static struct dual flnDual (double x, const struct dual *a, int na) {
+
+	return LOG_DUAL (x, a, na, DualLog);
+}
+
+//==============================================================================
+// Array kernels: evaluate the fit functions on n points at once, in vectorized
+// loops (see fitsimd.h). Y must not overlap X. Points whose exp/log argument
+// is out of the vector functions' range are re-evaluated by the scalar function.
+
+SIMD_CLONES static void flinArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	double a0 = a[0], a1 = a[1];
+	int i;
+
+	(void)m;
+	(void)na;
+	for (i = 0; i < n; i++)
+		Y[i] = a0 + a1 * X[i];
+}
+
+SIMD_CLONES static void fexpArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	double a0 = a[0], a1 = a[1];
+	int i;
+
+	(void)m;
+	for (i = 0; i < n; i++)
+		Y[i] = a0 * VecExp (a1 * X[i]);
+
+	for (i = 0; i < n; i++)
+		if (!ExpInRange (a1 * X[i]))
+			Y[i] = fexp (X[i], a, na);
+}
+
+// Horner's rule, one coefficient at a time over all points.
+SIMD_CLONES static void fpolyArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	double ak;
+	int i, k;
+
+	(void)m;
+	for (i = 0; i < n; i++)
+		Y[i] = a[na - 1];
+
+	for (k = na - 2; k >= 0; k--) {
+		ak = a[k];
+		for (i = 0; i < n; i++)
+			Y[i] = Y[i] * X[i] + ak;
+	}
+}
+
+SIMD_CLONES static void fgaussArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	double a0 = a[0], a1 = a[1], w = 2 * a[2] * a[2], t;
+	int i;
+
+	(void)m;
+	for (i = 0; i < n; i++) {
+		t = - (X[i] - a1) * (X[i] - a1) / w;
+		Y[i] = a0 * VecExp (t);
+	}
+
+	for (i = 0; i < n; i++) {
+		t = - (X[i] - a1) * (X[i] - a1) / w;
+		if (!ExpInRange (t))
+			Y[i] = fgauss (X[i], a, na);
+	}
+}
+
+SIMD_CLONES static void flogArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	double a0 = a[0], a1 = a[1];
+	int i;
+
+	(void)m;
+	for (i = 0; i < n; i++)
+		Y[i] = a0 * VecLog10 (a1 * X[i]);
+
+	for (i = 0; i < n; i++)
+		if (!LogInRange (a1 * X[i]))
+			Y[i] = flog (X[i], a, na);
+}
+
+SIMD_CLONES static void flnArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	double a0 = a[0], a1 = a[1];
+	int i;
+
+	(void)m;
+	for (i = 0; i < n; i++)
+		Y[i] = a0 * VecLog (a1 * X[i]);
+
+	for (i = 0; i < n; i++)
+		if (!LogInRange (a1 * X[i]))
+			Y[i] = fln (X[i], a, na);
+}
+
+//==============================================================================
+// Residual kernels: the model expression is inlined into the weighted residual
+// loop of CalcChi2Ws and specialized on the no. of parameters, so there's no
+// call per point or per block. RESIDUAL_KERNEL defines one: NA is the (fixed)
+// no. of parameters, copied to c[], MODEL (x) the model on x, SLOPE (x, f) its
+// df/dx from its value f, for the x errors, and INRANGE (x) whether the vector
+// exp/log handled x. Points outside are redone with the fit function FUNC, as
+// in the array kernels.
+
+#define RESIDUAL_KERNEL(NAME, NA, MODEL, SLOPE, INRANGE, FUNC)											\
+SIMD_CLONES static void NAME (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,	\
+							  double a[], int na, double r[], double s[]) {								\
+	double *X = ws->X + i0, *dX = ws->dX + i0, *Y = ws->Y + i0, *dY = ws->dY + i0;					\
+	double c[MAXPAR], x, f, fdx;																		\
+	int i, k, nc = NA;																					\
+																										\
+	(void)m;																							\
+	for (k = 0; k < nc; k++)																			\
+		c[k] = a[k];																					\
+																										\
+	if (!ws->hasdx) {																					\
+		for (i = 0; i < len; i++) {																		\
+			s[i] = dY[i];																				\
+			r[i] = (Y[i] - MODEL (X[i])) / s[i];														\
+		}																								\
+		for (i = 0; i < len; i++)																		\
+			if (!INRANGE (X[i]))																		\
+				r[i] = (Y[i] - FUNC (X[i], a, na)) / s[i];												\
+		return;																							\
+	}																									\
+																										\
+	for (i = 0; i < len; i++) {																			\
+		f = MODEL (X[i]);																				\
+		fdx = SLOPE (X[i], f) * dX[i];																	\
+		s[i] = sqrt (dY[i] * dY[i] + fdx * fdx);														\
+		r[i] = (Y[i] - f) / s[i];																		\
+	}																									\
+	for (i = 0; i < len; i++) {																			\
+		x = X[i];																						\
+		if (!INRANGE (x)) {																				\
+			f = FUNC (x, a, na);																		\
+			fdx = SLOPE (x, f) * dX[i];																	\
+			s[i] = sqrt (dY[i] * dY[i] + fdx * fdx);													\
+			r[i] = (Y[i] - f) / s[i];																	\
+		}																								\
+	}																									\
+}
+
+// Slope kernels, from the same expressions: f into Y and df/dx into D.
+#define SLOPE_KERNEL(NAME, NA, MODEL, SLOPE, INRANGE, FUNC)												\
+SIMD_CLONES static void NAME (const struct fitmodel *m, double X[], double Y[], double D[], int n,		\
+							  double a[], int na) {														\
+	double c[MAXPAR], f;																				\
+	int i, k, nc = NA;																					\
+																										\
+	(void)m;																							\
+	for (k = 0; k < nc; k++)																			\
+		c[k] = a[k];																					\
+																										\
+	for (i = 0; i < n; i++) {																			\
+		f = MODEL (X[i]);																				\
+		Y[i] = f;																						\
+		D[i] = SLOPE (X[i], f);																			\
+	}																									\
+	for (i = 0; i < n; i++)																				\
+		if (!INRANGE (X[i])) {																			\
+			Y[i] = FUNC (X[i], a, na);																	\
+			D[i] = SLOPE (X[i], Y[i]);																	\
+		}																								\
+}
+
+#define LIN_MODEL(x)		(c[0] + c[1] * (x))
+#define EXP_MODEL(x)		(c[0] * VecExp (c[1] * (x)))
+#define EXP_INRANGE(x)		ExpInRange (c[1] * (x))
+#define POLY_MODEL(x)		PolyHorner ((x), c, nc)
+#define GAUSS_ARG(x)		(- ((x) - c[1]) * ((x) - c[1]) / (2 * c[2] * c[2]))
+#define GAUSS_MODEL(x)		(c[0] * VecExp (GAUSS_ARG (x)))
+#define GAUSS_INRANGE(x)	ExpInRange (GAUSS_ARG (x))
+#define LOG_MODEL(x)		(c[0] * VecLog10 (c[1] * (x)))
+#define LN_MODEL(x)			(c[0] * VecLog (c[1] * (x)))
+#define LOG_INRANGE(x)		LogInRange (c[1] * (x))
+#define ALL_INRANGE(x)		1
+
+#define LIN_SLOPE(x, f)		(c[1])
+#define EXP_SLOPE(x, f)		(c[1] * (f))
+#define POLY_SLOPE(x, f)	PolySlope ((x), c, nc)
+#define GAUSS_SLOPE(x, f)	(- (f) * ((x) - c[1]) / (c[2] * c[2]))
+#define LOG_SLOPE(x, f)		(c[0] * LOG10E / (x))
+#define LN_SLOPE(x, f)		(c[0] / (x))
+
+SIMD_INLINE double PolyHorner (double x, const double c[], int nc) {
+	double y = c[nc - 1];
+	int k;
+
+	for (k = nc - 2; k >= 0; k--)
+		y = y * x + c[k];
+
+	return y;
+}
+
+// df/dx of the polynomial, by Horner's rule on its derivative's coefficients.
+SIMD_INLINE double PolySlope (double x, const double c[], int nc) {
+	double y = (nc - 1) * c[nc - 1];
+	int k;
+
+	for (k = nc - 2; k >= 1; k--)
+		y = y * x + k * c[k];
+
+	return y;
+}
+
+RESIDUAL_KERNEL (flinResiduals,		2,	LIN_MODEL,		LIN_SLOPE,		ALL_INRANGE,	flin)
+RESIDUAL_KERNEL (fexpResiduals,		2,	EXP_MODEL,		EXP_SLOPE,		EXP_INRANGE,	fexp)
+RESIDUAL_KERNEL (fgaussResiduals,	3,	GAUSS_MODEL,	GAUSS_SLOPE,	GAUSS_INRANGE,	fgauss)
+RESIDUAL_KERNEL (flogVecResiduals,	2,	LOG_MODEL,		LOG_SLOPE,		LOG_INRANGE,	flog)
+RESIDUAL_KERNEL (flnVecResiduals,	2,	LN_MODEL,		LN_SLOPE,		LOG_INRANGE,	fln)
+
+// One polynomial kernel per no. of parameters, each with its Horner loop unrolled.
+RESIDUAL_KERNEL (fpoly1Residuals,	1,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly2Residuals,	2,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly3Residuals,	3,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly4Residuals,	4,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly5Residuals,	5,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly6Residuals,	6,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly7Residuals,	7,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly8Residuals,	8,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly9Residuals,	9,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly10Residuals,	10,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+RESIDUAL_KERNEL (fpoly11Residuals,	11,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+
+static void fpolyResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+							double a[], int na, double r[], double s[]) {
+	static const fitresidualfunc kernels[MAXPAR] = {
+		fpoly1Residuals, fpoly2Residuals, fpoly3Residuals, fpoly4Residuals, fpoly5Residuals, fpoly6Residuals,
+		fpoly7Residuals, fpoly8Residuals, fpoly9Residuals, fpoly10Residuals, fpoly11Residuals
+	};
+
+	kernels[na - 1] (m, ws, i0, len, a, na, r, s);
+}
+
+SLOPE_KERNEL (flinSlope,	2,	LIN_MODEL,		LIN_SLOPE,		ALL_INRANGE,	flin)
+SLOPE_KERNEL (fexpSlope,	2,	EXP_MODEL,		EXP_SLOPE,		EXP_INRANGE,	fexp)
+SLOPE_KERNEL (fpolySlope,	na,	POLY_MODEL,		POLY_SLOPE,		ALL_INRANGE,	fpoly)
+SLOPE_KERNEL (fgaussSlope,	3,	GAUSS_MODEL,	GAUSS_SLOPE,	GAUSS_INRANGE,	fgauss)
+SLOPE_KERNEL (flogSlope,	2,	LOG_MODEL,		LOG_SLOPE,		LOG_INRANGE,	flog)
+SLOPE_KERNEL (flnSlope,		2,	LN_MODEL,		LN_SLOPE,		LOG_INRANGE,	fln)
+
+// LOG and LN from the log |x| cached in the workspace (FIT_FEAT_LOGX): log (a1 x) = log |a1| + log |x|
+// for a1 x > 0, so the loop has no log at all, and df/dx = a0 SCALE / x. SCALE is 1 for ln and log10 (e)
+// for log10. Points with a1 x <= 0 are evaluated by FUNC.
+#define LOGX_RESIDUAL_KERNEL(NAME, SCALE, FUNC)																\
+SIMD_CLONES static void NAME (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,	\
+							  double a[], int na, double r[], double s[]) {								\
+	double *X = ws->X + i0, *dX = ws->dX + i0, *Y = ws->Y + i0, *dY = ws->dY + i0;					\
+	double *L = ws->logx + i0, c0 = a[0] * SCALE, c1 = a[1], lc1 = log (fabs (a[1])), fdx;				\
+	int i;																								\
+																										\
+	(void)m;																							\
+	if (!ws->hasdx) {																					\
+		for (i = 0; i < len; i++) {																		\
+			s[i] = dY[i];																				\
+			r[i] = (Y[i] - c0 * (lc1 + L[i])) / s[i];													\
+		}																								\
+		for (i = 0; i < len; i++)																		\
+			if (!(c1 * X[i] > 0))																		\
+				r[i] = (Y[i] - FUNC (X[i], a, na)) / s[i];												\
+		return;																							\
+	}																									\
+																										\
+	for (i = 0; i < len; i++) {																			\
+		fdx = c0 / X[i] * dX[i];																		\
+		s[i] = sqrt (dY[i] * dY[i] + fdx * fdx);														\
+		r[i] = (Y[i] - c0 * (lc1 + L[i])) / s[i];														\
+	}																									\
+	for (i = 0; i < len; i++)																			\
+		if (!(c1 * X[i] > 0))																			\
+			r[i] = (Y[i] - FUNC (X[i], a, na)) / s[i];													\
+}
+
+LOGX_RESIDUAL_KERNEL (flogCachedResiduals,	LOG10E,	flog)
+LOGX_RESIDUAL_KERNEL (flnCachedResiduals,	1.0,	fln)
+
+static void flogResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						   double a[], int na, double r[], double s[]) {
+
+	if (ws->features & FIT_FEAT_LOGX)
+		flogCachedResiduals (m, ws, i0, len, a, na, r, s);
+	else
+		flogVecResiduals (m, ws, i0, len, a, na, r, s);
+}
+
+static void flnResiduals (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						  double a[], int na, double r[], double s[]) {
+
+	if (ws->features & FIT_FEAT_LOGX)
+		flnCachedResiduals (m, ws, i0, len, a, na, r, s);
+	else
+		flnVecResiduals (m, ws, i0, len, a, na, r, s);
+}
+
+//==============================================================================
+// Jacobian kernels: the residual kernels in dual numbers, specialized on the no. of
+// parameters NA like them, so that the derivatives are plain variables and the loops
+// vectorize. MODEL (x) is the model's dual expression with the vector exp or log, SLOPE (x, f)
+// that of its df/dx from its value f, and points outside their range are redone with the
+// dual fit function DUALFUNC. The results go to local buffers first (len <= SIMD_BLOCK):
+// stores through the na rows of J would need too many aliasing checks to vectorize.
+
+SIMD_INLINE struct dual DualVecExp (struct dual u, int na) {
+	double e = VecExp (u.v);
+
+	return DualChain (u, e, e, na);
+}
+
+SIMD_INLINE struct dual DualVecLog (struct dual u, int na) {
+
+	return DualChain (u, VecLog (u.v), 1 / u.v, na);
+}
+
+SIMD_INLINE struct dual DualVecLog10 (struct dual u, int na) {
+
+	return DualChain (u, VecLog10 (u.v), LOG10E / u.v, na);
+}
+
+#define JACOBIAN_KERNEL(NAME, NA, MODEL, SLOPE, INRANGE, DUALFUNC)										\
+SIMD_CLONES static void NAME (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,	\
+							  double a[], int na, double r[], double s[], double *J[]) {				\
+	double *X = ws->X + i0, *dX = ws->dX + i0, *Y = ws->Y + i0, *dY = ws->dY + i0;					\
+	double rl[SIMD_BLOCK], sl[SIMD_BLOCK], Jl[MAXPAR][SIMD_BLOCK];										\
+	struct dual c[MAXPAR], fd, sd, rd;																	\
+	int i, k, nc = NA;																					\
+																										\
+	(void)m;																							\
+	(void)na;																							\
+	for (k = 0; k < nc; k++) {																			\
+		c[k] = DualConst (a[k], nc);																	\
+		c[k].d[k] = 1;																					\
+	}																									\
+																										\
+	if (!ws->hasdx) {																					\
+		for (i = 0; i < len; i++) {																		\
+			sd = DualConst (dY[i], nc);																	\
+			rd = DualResidual (MODEL (X[i]), sd, Y[i], nc);												\
+			JACOBIAN_STORE;																				\
+		}																								\
+		for (i = 0; i < len; i++)																		\
+			if (!INRANGE (X[i])) {																		\
+				sd = DualConst (dY[i], nc);																\
+				rd = DualResidual (DUALFUNC (X[i], c, nc), sd, Y[i], nc);								\
+				JACOBIAN_STORE;																			\
+			}																							\
+	}																									\
+	else {																								\
+		for (i = 0; i < len; i++) {																		\
+			fd = MODEL (X[i]);																			\
+			sd = DualSigma (DualMulC (SLOPE (X[i], fd), dX[i], nc), dY[i], nc);							\
+			rd = DualResidual (fd, sd, Y[i], nc);														\
+			JACOBIAN_STORE;																				\
+		}																								\
+		for (i = 0; i < len; i++)																		\
+			if (!INRANGE (X[i])) {																		\
+				fd = DUALFUNC (X[i], c, nc);															\
+				sd = DualSigma (DualMulC (SLOPE (X[i], fd), dX[i], nc), dY[i], nc);						\
+				rd = DualResidual (fd, sd, Y[i], nc);													\
+				JACOBIAN_STORE;																			\
+			}																							\
+	}																									\
+																										\
+	memcpy (r, rl, len * sizeof (double));																\
+	memcpy (s, sl, len * sizeof (double));																\
+	for (k = 0; k < nc; k++)																			\
+		memcpy (J[k], Jl[k], len * sizeof (double));													\
+}
+
+#define JACOBIAN_STORE																					\
+	do {																								\
+		sl[i] = sd.v;																					\
+		rl[i] = rd.v;																					\
+		for (k = 0; k < nc; k++)																		\
+			Jl[k][i] = rd.d[k];																			\
+	} while (0)
+
+#define LIN_JMODEL(x)		LIN_DUAL ((x), c, nc, DualVecExp)
+#define EXP_JMODEL(x)		EXP_DUAL ((x), c, nc, DualVecExp)
+#define EXP_JINRANGE(x)		ExpInRange (c[1].v * (x))
+#define POLY_JMODEL(x)		PolyHornerDual ((x), c, nc)
+#define GAUSS_JMODEL(x)		GAUSS_DUAL ((x), c, nc, DualVecExp)
+#define GAUSS_JINRANGE(x)	ExpInRange (GaussArgDual ((x), c, nc).v)
+#define LOG_JMODEL(x)		LOG_DUAL ((x), c, nc, DualVecLog10)
+#define LN_JMODEL(x)		LOG_DUAL ((x), c, nc, DualVecLog)
+#define LOG_JINRANGE(x)		LogInRange (c[1].v * (x))
+
+#define LIN_JSLOPE(x, f)	(c[1])
+#define EXP_JSLOPE(x, f)	DualMul (c[1], (f), nc)
+#define POLY_JSLOPE(x, f)	PolySlopeDual ((x), c, nc)
+#define GAUSS_JSLOPE(x, f)	DualDiv (DualMul ((f), DualAddC (c[1], -(x)), nc), DualMul (c[2], c[2], nc), nc)
+#define LOG_JSLOPE(x, f)	DualMulC (c[0], LOG10E / (x), nc)
+#define LN_JSLOPE(x, f)		DualMulC (c[0], 1 / (x), nc)
+
+JACOBIAN_KERNEL (flinJacobian,		2,	LIN_JMODEL,		LIN_JSLOPE,		ALL_INRANGE,	flinDual)
+JACOBIAN_KERNEL (fexpJacobian,		2,	EXP_JMODEL,		EXP_JSLOPE,		EXP_JINRANGE,	fexpDual)
+JACOBIAN_KERNEL (fgaussJacobian,	3,	GAUSS_JMODEL,	GAUSS_JSLOPE,	GAUSS_JINRANGE,	fgaussDual)
+JACOBIAN_KERNEL (flogJacobian,		2,	LOG_JMODEL,		LOG_JSLOPE,		LOG_JINRANGE,	flogDual)
+JACOBIAN_KERNEL (flnJacobian,		2,	LN_JMODEL,		LN_JSLOPE,		LOG_JINRANGE,	flnDual)
+
+JACOBIAN_KERNEL (fpoly1Jacobian,	1,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly2Jacobian,	2,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly3Jacobian,	3,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly4Jacobian,	4,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly5Jacobian,	5,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly6Jacobian,	6,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly7Jacobian,	7,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly8Jacobian,	8,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly9Jacobian,	9,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly10Jacobian,	10,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+JACOBIAN_KERNEL (fpoly11Jacobian,	11,	POLY_JMODEL,	POLY_JSLOPE,	ALL_INRANGE,	fpolyDual)
+
+static void fpolyJacobian (const struct fitmodel *m, const struct fitworkspace *ws, int i0, int len,
+						   double a[], int na, double r[], double s[], double *J[]) {
+	static const fitjacobianfunc kernels[MAXPAR] = {
+		fpoly1Jacobian, fpoly2Jacobian, fpoly3Jacobian, fpoly4Jacobian, fpoly5Jacobian, fpoly6Jacobian,
+		fpoly7Jacobian, fpoly8Jacobian, fpoly9Jacobian, fpoly10Jacobian, fpoly11Jacobian
+	};
+
+	kernels[na - 1] (m, ws, i0, len, a, na, r, s, J);
+}
+
+/// HIFN  Evaluates the model on the n points of X into Y: by its array kernel if it has one,
+/// HIFN  otherwise by calling its fit function on each point. Y must not overlap X.
+
+void ModelEvalArray (const struct fitmodel *m, double X[], double Y[], int n, double a[], int na) {
+	int i;
+
+	if (m->funcarray) {
+		m->funcarray (m, X, Y, n, a, na);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		Y[i] = m->func (X[i], a, na);
+}
+
+// Returns the model of the given fittype, or NULL if there's no such model.
+const struct fitmodel *GetFitModel (int type) {
+	
+	if (type < 0 || type >= NFITTYPES)
+		return NULL;
+	
+	return &models[type];
+}
+
+// Returns the model with the given short name ("lin", "poly"...), or NULL.
+const struct fitmodel *FindFitModel (const char *name) {
+	int i;
+	
+	for (i = 0; i < NFITTYPES; i++)
+		if (strcmp (models[i].name, name) == 0)
+			return &models[i];
+	
+	return NULL;
+}
+
+// Returns the built-in model whose fit function is func, or NULL.
+const struct fitmodel *FindFitModelFunc (fitfunc func) {
+	int i;
+	
+	for (i = 0; i < NFITTYPES; i++)
+		if (models[i].func == func)
+			return &models[i];
+	
+	return NULL;
+}
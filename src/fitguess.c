@@ -0,0 +1,194 @@
+//==============================================================================
+//
+// Title:		fitguess.c
+// Purpose:		Initial parameters' estimation for every fit type (replaces the
+//				CVI LinearFitEx, PolyFitWithWeight, ExpFitEx, GaussFit and LogFit
+//				calls made by the GUI).
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Static functions
+
+// Maps a data point to the (u, v) plane where the model is a polynomial in u, and
+// propagates dY to a weight of v. Returns 0 if the point can't be linearized.
+static int Linearize (int type, double x, double y, double dy, double ysign, double *u, double *v, double *w) {
+
+	switch (type) {
+		case EXP:
+		case GAUSS:
+			if (y * ysign <= 0)
+				return 0;
+			*u = x;
+			*v = log (y * ysign);
+			*w = y * y / (dy * dy);
+			return 1;
+
+		case LOG:
+		case LN:
+			if (x <= 0)
+				return 0;
+			*u = (type == LOG) ? log10 (x) : log (x);
+			*v = y;
+			*w = 1 / (dy * dy);
+			return 1;
+
+		default:
+			*u = x;
+			*v = y;
+			*w = 1 / (dy * dy);
+			return 1;
+	}
+}
+
+// Weighted polynomial fit of degree m - 1 of v vs u (see Linearize). u is centered and
+// scaled to [-1, 1] before fitting to keep high degrees well conditioned; the coefficients
+// are then converted back to powers of u. Returns the no. of points used, or -1 on failure.
+static int PolyGuess (int type, double X[], double Y[], double dY[], int n, double ysign, double a[], int m) {
+	double row[MAXPAR], b[MAXPAR], umin = DBL_MAX, umax = -DBL_MAX, c, s, binom, t, u, v, w;
+	struct lsqacc acc;
+	int i, j, k, used = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!Linearize (type, X[i], Y[i], dY[i], ysign, &u, &v, &w))
+			continue;
+		if (u < umin)
+			umin = u;
+		if (u > umax)
+			umax = u;
+		used++;
+	}
+	if (used < m)
+		return -1;
+	c = 0.5 * (umax + umin);
+	s = 0.5 * (umax - umin);
+	if (s == 0)
+		s = 1;
+
+	LsqInit (&acc, m);
+	for (i = 0; i < n; i++) {
+		if (!Linearize (type, X[i], Y[i], dY[i], ysign, &u, &v, &w))
+			continue;
+		t = (u - c) / s;
+		row[0] = 1;
+		for (j = 1; j < m; j++)
+			row[j] = row[j - 1] * t;
+		LsqAddRow (&acc, row, v, w);
+	}
+	if (LsqSolve (&acc, b) < 0)
+		return -1;
+
+	// sum b[k] ((u - c) / s)^k = sum a[j] u^j.
+	memset (a, 0, m * sizeof (double));
+	for (k = 0; k < m; k++) {
+		t = b[k] / pow (s, k);
+		binom = 1;
+		for (j = 0; j <= k; j++) {
+			a[j] += t * binom * pow (-c, k - j);
+			binom = binom * (k - j) / (j + 1);
+		}
+	}
+
+	return used;
+}
+
+// Gaussian estimate from the moments of the data, used when log(y) isn't a downward parabola.
+static void GaussMoments (double X[], double Y[], int n, double a[]) {
+	double sw = 0, sx = 0, sxx = 0, ymax = Y[0];
+	int i, imax = 0;
+
+	for (i = 0; i < n; i++) {
+		if (fabs (Y[i]) > fabs (ymax)) {
+			ymax = Y[i];
+			imax = i;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		sw += Y[i] / ymax;
+		sx += X[i] * Y[i] / ymax;
+	}
+	for (i = 0; i < n; i++)
+		sxx += (X[i] - sx / sw) * (X[i] - sx / sw) * Y[i] / ymax;
+
+	a[0] = ymax;
+	a[1] = X[imax];
+	a[2] = (sw > 0 && sxx > 0) ? sqrt (sxx / sw) : 1;
+}
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Estimates initial parameters of the given fit type by linear least squares
+/// HIFN  on the data, or a linearized form of it (log y for EXP and GAUSS, log x for LOG and LN).
+/// HIPAR na/No. of parameters; only used for POLY.
+/// HIRET FIT_OK, FIT_ERR_DOMAIN when X or Y values can't be linearized, FIT_ERR_ARGS otherwise.
+
+int InitialGuess (int type, double X[], double Y[], double dY[], int n, double a[], int na) {
+	double c[3], ysign = 1;
+	int i;
+
+	if (n < 1)
+		return FIT_ERR_ARGS;
+
+	// Fit -y when the data is negative, so log (y) is defined.
+	for (i = 0; i < n; i++)
+		if (Y[i] < 0)
+			ysign = -1;
+
+	switch (type) {
+		case LIN:
+			return PolyGuess (LIN, X, Y, dY, n, 1, a, 2) < 0 ? FIT_ERR_ARGS : FIT_OK;
+
+		case POLY:
+			if (na < 1 || na > MAXPAR || n < na)
+				return FIT_ERR_ARGS;
+			return PolyGuess (POLY, X, Y, dY, n, 1, a, na) < 0 ? FIT_ERR_ARGS : FIT_OK;
+
+		// ln|y| = ln|a0| + a1 * x.
+		case EXP:
+			if (PolyGuess (EXP, X, Y, dY, n, ysign, c, 2) < 0)
+				return FIT_ERR_DOMAIN;
+			a[0] = ysign * exp (c[0]);
+			a[1] = c[1];
+			return FIT_OK;
+
+		// ln|y| = ln|a0| - (x - a1)^2 / (2 a2^2) is a parabola in x.
+		case GAUSS:
+			if (PolyGuess (GAUSS, X, Y, dY, n, ysign, c, 3) > 0 && c[2] < 0) {
+				a[2] = sqrt (-1 / (2 * c[2]));
+				a[1] = c[1] * a[2] * a[2];
+				a[0] = ysign * exp (c[0] + a[1] * a[1] / (2 * a[2] * a[2]));
+			}
+			else
+				GaussMoments (X, Y, n, a);
+			return FIT_OK;
+
+		// y = a0 * log (x) + a0 * log (a1) is a line in log (x).
+		case LOG:
+		case LN:
+			for (i = 0; i < n; i++)
+				if (X[i] <= 0)
+					return FIT_ERR_DOMAIN;
+			if (PolyGuess (type, X, Y, dY, n, 1, c, 2) < 0 || c[1] == 0)
+				return FIT_ERR_DOMAIN;
+			a[0] = c[1];
+			a[1] = (type == LOG) ? pow (10, c[0] / c[1]) : exp (c[0] / c[1]);
+			return FIT_OK;
+	}
+
+	return FIT_ERR_ARGS;
+}
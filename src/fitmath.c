@@ -0,0 +1,347 @@
+//==============================================================================
+//
+// Title:		fitmath.c
+// Purpose:		Linear algebra and statistics used by the fitting library
+//				(replaces the CVI Analysis library functions).
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Constants
+
+#define GAMMA_ITMAX		500
+#define GAMMA_EPS		1e-15
+#define GAMMA_FPMIN		1e-300
+#define SVD_MAXSWEEPS	60		// Jacobi sweeps of MatPseudoInvert; a few usually do.
+
+//==============================================================================
+// Static functions
+
+// Regularized lower incomplete gamma function P(s, x) by its series (x < s + 1).
+static double GammaSeries (double s, double x) {
+	double sum, del, ap;
+	int i;
+
+	ap = s;
+	sum = del = 1 / s;
+	for (i = 0; i < GAMMA_ITMAX; i++) {
+		ap += 1;
+		del *= x / ap;
+		sum += del;
+		if (fabs (del) < fabs (sum) * GAMMA_EPS)
+			break;
+	}
+
+	return sum * exp (-x + s * log (x) - lgamma (s));
+}
+
+// Regularized upper incomplete gamma function Q(s, x) by its continued fraction (x >= s + 1).
+static double GammaContFrac (double s, double x) {
+	double an, b, c, d, del, h;
+	int i;
+
+	b = x + 1 - s;
+	c = 1 / GAMMA_FPMIN;
+	d = 1 / b;
+	h = d;
+	for (i = 1; i < GAMMA_ITMAX; i++) {
+		an = -i * (i - s);
+		b += 2;
+		d = an * d + b;
+		if (fabs (d) < GAMMA_FPMIN)
+			d = GAMMA_FPMIN;
+		c = b + an / c;
+		if (fabs (c) < GAMMA_FPMIN)
+			c = GAMMA_FPMIN;
+		d = 1 / d;
+		del = d * c;
+		h *= del;
+		if (fabs (del - 1) < GAMMA_EPS)
+			break;
+	}
+
+	return exp (-x + s * log (x) - lgamma (s)) * h;
+}
+
+// Cholesky decomposition A = L L^T of a symmetric positive definite n x n matrix A, into the
+// lower triangle of L. Returns -1 if A isn't positive definite.
+static int CholeskyFactor (const double A[], int n, double L[]) {
+	double t;
+	int i, j, k;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j <= i; j++) {
+			t = A[i * n + j];
+			for (k = 0; k < j; k++)
+				t -= L[i * n + k] * L[j * n + k];
+			if (i == j) {
+				if (!(t > 0))
+					return -1;
+				L[i * n + i] = sqrt (t);
+			}
+			else
+				L[i * n + j] = t / L[j * n + j];
+		}
+	}
+
+	return 0;
+}
+
+//==============================================================================
+// Global functions
+
+// Solves A x = b for a symmetric positive definite n x n matrix A by Cholesky
+// decomposition. A and b are left unchanged. Returns -1 if A isn't positive definite.
+int CholeskySolve (double A[], int n, double b[], double x[]) {
+	double L[n * n], t;
+	int i, k;
+	
+	if (CholeskyFactor (A, n, L) < 0)
+		return -1;
+	
+	// L y = b, then L^T x = y.
+	for (i = 0; i < n; i++) {
+		t = b[i];
+		for (k = 0; k < i; k++)
+			t -= L[i * n + k] * x[k];
+		x[i] = t / L[i * n + i];
+	}
+	for (i = n - 1; i >= 0; i--) {
+		t = x[i];
+		for (k = i + 1; k < n; k++)
+			t -= L[k * n + i] * x[k];
+		x[i] = t / L[i * n + i];
+	}
+	
+	return 0;
+}
+
+// Inverts the symmetric positive definite n x n matrix A into Ainv by Cholesky decomposition:
+// Ainv = L^-T L^-1. A is left unchanged. Returns -1 if A isn't positive definite.
+int CholeskyInvert (double A[], int n, double Ainv[]) {
+	double L[n * n], Linv[n * n], t;
+	int i, j, k;
+
+	if (CholeskyFactor (A, n, L) < 0)
+		return -1;
+
+	// Linv is lower triangular too: solve L Linv = I one column at a time.
+	memset (Linv, 0, n * n * sizeof (double));
+	for (j = 0; j < n; j++)
+		for (i = j; i < n; i++) {
+			t = (i == j);
+			for (k = j; k < i; k++)
+				t -= L[i * n + k] * Linv[k * n + j];
+			Linv[i * n + j] = t / L[i * n + i];
+		}
+
+	for (i = 0; i < n; i++)
+		for (j = i; j < n; j++) {
+			t = 0;
+			for (k = j; k < n; k++)
+				t += Linv[k * n + i] * Linv[k * n + j];
+			Ainv[i * n + j] = Ainv[j * n + i] = t;
+		}
+
+	return 0;
+}
+
+// Pseudo-inverse of the n x n matrix A into Ainv, by singular value decomposition A = U S V^T
+// with one-sided Jacobi rotations: Ainv = V S^+ U^T, where singular values below n DBL_EPSILON
+// times the largest count as 0. A is left unchanged. Returns the rank of A.
+int MatPseudoInvert (double A[], int n, double Ainv[]) {
+	double W[n * n], V[n * n], s2[n], p, q, r, zeta, t, c, sn, x, y, s2max = 0;
+	int i, j, k, l, sweep, rotated, rank = 0;
+
+	// The columns of W = A V are made orthogonal: they're then U S.
+	memcpy (W, A, n * n * sizeof (double));
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+			V[i * n + j] = (i == j);
+
+	for (sweep = 0; sweep < SVD_MAXSWEEPS; sweep++) {
+		rotated = 0;
+		for (j = 0; j < n - 1; j++)
+			for (k = j + 1; k < n; k++) {
+				p = q = r = 0;
+				for (i = 0; i < n; i++) {
+					p += W[i * n + j] * W[i * n + j];
+					q += W[i * n + k] * W[i * n + k];
+					r += W[i * n + j] * W[i * n + k];
+				}
+				if (!(fabs (r) > DBL_EPSILON * sqrt (p * q)))
+					continue;
+				rotated = 1;
+
+				// The rotation by atan (t) that zeroes the product of columns j and k.
+				zeta = (q - p) / (2 * r);
+				t = (zeta >= 0 ? 1 : -1) / (fabs (zeta) + sqrt (1 + zeta * zeta));
+				c = 1 / sqrt (1 + t * t);
+				sn = c * t;
+				for (i = 0; i < n; i++) {
+					x = W[i * n + j];
+					y = W[i * n + k];
+					W[i * n + j] = c * x - sn * y;
+					W[i * n + k] = sn * x + c * y;
+					x = V[i * n + j];
+					y = V[i * n + k];
+					V[i * n + j] = c * x - sn * y;
+					V[i * n + k] = sn * x + c * y;
+				}
+			}
+		if (!rotated)
+			break;
+	}
+
+	// s2 = S^2, the squared column norms of W.
+	for (j = 0; j < n; j++) {
+		s2[j] = 0;
+		for (i = 0; i < n; i++)
+			s2[j] += W[i * n + j] * W[i * n + j];
+		if (s2[j] > s2max)
+			s2max = s2[j];
+	}
+	for (j = 0; j < n; j++) {
+		if (s2[j] > s2max * (n * DBL_EPSILON) * (n * DBL_EPSILON))
+			rank++;
+		else
+			s2[j] = 0;
+	}
+
+	// V S^-1 U^T = V S^-2 W^T.
+	for (i = 0; i < n; i++)
+		for (l = 0; l < n; l++) {
+			t = 0;
+			for (j = 0; j < n; j++)
+				if (s2[j] > 0)
+					t += V[i * n + j] * W[l * n + j] / s2[j];
+			Ainv[i * n + l] = t;
+		}
+
+	return rank;
+}
+
+// Resets acc to an empty least squares problem with m unknowns.
+void LsqInit (struct lsqacc *acc, int m) {
+
+	memset (acc, 0, sizeof (*acc));
+	acc->m = m;
+}
+
+// Adds the equation row . coef = y with weight w (1 / sigma^2) to acc.
+// row is used as scratch space and is overwritten.
+void LsqAddRow (struct lsqacc *acc, double row[], double y, double w) {
+	double sw, r, c, s, t, *R = acc->R;
+	int j, k, m = acc->m;
+
+	if (!(w > 0))
+		return;
+
+	sw = sqrt (w);
+	for (j = 0; j < m; j++)
+		row[j] *= sw;
+	y *= sw;
+
+	// Rotate the row into R, one column at a time.
+	for (k = 0; k < m; k++) {
+		if (row[k] == 0)
+			continue;
+		r = hypot (R[k * m + k], row[k]);
+		c = R[k * m + k] / r;
+		s = row[k] / r;
+		R[k * m + k] = r;
+		for (j = k + 1; j < m; j++) {
+			t = R[k * m + j];
+			R[k * m + j] = c * t + s * row[j];
+			row[j] = c * row[j] - s * t;
+		}
+		t = acc->qty[k];
+		acc->qty[k] = c * t + s * y;
+		y = c * y - s * t;
+	}
+
+	acc->sse += y * y;
+}
+
+// Solves R coef = Q^T y by back substitution. Returns -1 if the problem is rank deficient.
+int LsqSolve (const struct lsqacc *acc, double coef[]) {
+	const double *R = acc->R;
+	double t, rmax = 0;
+	int j, k, m = acc->m;
+
+	for (k = 0; k < m; k++)
+		if (fabs (R[k * m + k]) > rmax)
+			rmax = fabs (R[k * m + k]);
+
+	for (k = m - 1; k >= 0; k--) {
+		if (fabs (R[k * m + k]) <= rmax * m * DBL_EPSILON)
+			return -1;
+		t = acc->qty[k];
+		for (j = k + 1; j < m; j++)
+			t -= R[k * m + j] * coef[j];
+		coef[k] = t / R[k * m + k];
+	}
+
+	return 0;
+}
+
+// Covariance (A^T W A)^-1 = R^-1 R^-T of the coefficients solved by LsqSolve, into the m x m
+// matrix cov. Returns -1 if the problem is rank deficient.
+int LsqCovariance (const struct lsqacc *acc, double cov[]) {
+	const double *R = acc->R;
+	int i, j, k, m = acc->m;
+	double Rinv[m * m], t, rmax = 0;
+
+	for (k = 0; k < m; k++)
+		if (fabs (R[k * m + k]) > rmax)
+			rmax = fabs (R[k * m + k]);
+
+	// Rinv is upper triangular too: solve R Rinv = I one column at a time.
+	memset (Rinv, 0, m * m * sizeof (double));
+	for (j = 0; j < m; j++)
+		for (k = j; k >= 0; k--) {
+			if (fabs (R[k * m + k]) <= rmax * m * DBL_EPSILON)
+				return -1;
+			t = (k == j);
+			for (i = k + 1; i <= j; i++)
+				t -= R[k * m + i] * Rinv[i * m + j];
+			Rinv[k * m + j] = t / R[k * m + k];
+		}
+
+	for (i = 0; i < m; i++)
+		for (j = i; j < m; j++) {
+			t = 0;
+			for (k = j; k < m; k++)
+				t += Rinv[i * m + k] * Rinv[j * m + k];
+			cov[i * m + j] = cov[j * m + i] = t;
+		}
+
+	return 0;
+}
+
+// Returns the probability that a chi^2 distributed variable with ndf degrees of
+// freedom exceeds chisq, i.e. 1 - CDF(chisq).
+double ChiSqProb (double chisq, int ndf) {
+	double s = 0.5 * ndf, x = 0.5 * chisq;
+
+	if (ndf <= 0 || chisq <= 0)
+		return 1;
+
+	if (x < s + 1)
+		return 1 - GammaSeries (s, x);
+
+	return GammaContFrac (s, x);
+}
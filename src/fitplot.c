@@ -0,0 +1,476 @@
+//==============================================================================
+//
+// Title:		fitplot.c
+// Purpose:		Headless rendering of a fit to an SVG file: data with error
+//				bars, fitted and initial functions and residuals, as the GUI
+//				graphs show them. Large datasets are decimated to the pixel
+//				columns of the plot, so the time is linear in the no. of
+//				points and the file size is bounded by the plot's width.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Constants
+
+#define PLOTLEFT		70			// Margins around the graphs, in pixels.
+#define PLOTRIGHT		20
+#define PLOTTOP			40
+#define PLOTBOTTOM		50
+#define PLOTGAP			40			// Between the graph and the residuals graph.
+#define PLOTRESFRAC		0.3			// Share of the height given to the residuals graph.
+#define PLOTALL			2			// Points per pixel column up to which every point is drawn.
+#define PLOTBLOCK		4096		// No. of points whose residuals are evaluated together.
+#define PLOTCURVE		8192		// Max no. of points of a function.
+#define PLOTTICKS		6			// About this many ticks per axis...
+#define PLOTMAXTICKS	20			// ...and at most this many.
+
+#define COLOR_DATA		"#0000ff"	// The GUI's colors.
+#define COLOR_FIT		"#ff0000"
+#define COLOR_INIT		"#00ff00"
+#define COLOR_ZERO		"#ff0000"
+
+//==============================================================================
+// Types
+
+// A graph: its place in the image and the data range it shows.
+struct panel {
+	double left, top, width, height;
+	double xmin, xmax, ymin, ymax;
+	int id;							// Suffix of its clip path.
+};
+
+// The points of a dataset falling in one pixel column of a graph.
+struct plotcol {
+	int n;
+	double xsum, ysum;				// Of the points, for their centroid.
+	double ymin, ymax;				// Extent of the points...
+	double lo, hi;					// ...and of their error bars.
+	double area;					// Largest triangle so far, and the point that makes it.
+	int best;
+};
+
+//==============================================================================
+// Static functions
+
+static double PX (const struct panel *p, double x) {
+	return p->left + (x - p->xmin) / (p->xmax - p->xmin) * p->width;
+}
+
+// Off-graph values are clamped, they're clipped anyway.
+static double PY (const struct panel *p, double y) {
+	double py = p->top + (p->ymax - y) / (p->ymax - p->ymin) * p->height;
+
+	if (py < p->top - 10 * p->height)
+		return p->top - 10 * p->height;
+	if (py > p->top + 11 * p->height)
+		return p->top + 11 * p->height;
+	return py;
+}
+
+static void PutText (FILE *f, const char *s) {
+
+	for ( ; s && *s; s++)
+		switch (*s) {
+			case '<':	fputs ("&lt;", f);		break;
+			case '>':	fputs ("&gt;", f);		break;
+			case '&':	fputs ("&amp;", f);		break;
+			case '"':	fputs ("&quot;", f);	break;
+			default:	fputc (*s, f);
+		}
+}
+
+// Widens [*lo, *hi] by 5% on each side, or to a unit range if it's empty (wider far from 0,
+// where 1 is below the resolution of the values).
+static void Pad (double *lo, double *hi) {
+	double d = *hi - *lo;
+
+	if (!(*lo <= *hi)) {
+		*lo = -1;
+		*hi = 1;
+	}
+	else if (d == 0) {
+		d = fabs (*lo) * 1e-9 > 1 ? fabs (*lo) * 1e-9 : 1;
+		*lo -= d;
+		*hi += d;
+	}
+	else {
+		*lo -= 0.05 * d;
+		*hi += 0.05 * d;
+	}
+}
+
+// Y values of the points i0 ... i0 + len - 1 of d: their residuals from the model if m is set.
+static void BlockY (const struct dataset *d, const struct fitmodel *m, double a[], int na, int i0, int len,
+					double y[]) {
+	int i;
+
+	if (!m) {
+		memcpy (y, d->Y + i0, len * sizeof (double));
+		return;
+	}
+	ModelEvalArray (m, d->X + i0, y, len, a, na);
+	for (i = 0; i < len; i++)
+		y[i] = d->Y[i0 + i] - y[i];
+}
+
+static int Column (const struct panel *p, int ncol, double x) {
+	int c = (int)((x - p->xmin) / (p->xmax - p->xmin) * ncol);
+
+	return c < 0 ? 0 : c >= ncol ? ncol - 1 : c;
+}
+
+// Bins the points (or residuals) of d into the pixel columns of p and finds their Y range.
+// Then picks the point of every column as LTTB does: the one making the largest triangle
+// with its neighbour columns, here their centroids, so that no sorting is needed.
+static int Aggregate (const struct dataset *d, const struct fitmodel *m, double a[], int na,
+					  const struct panel *p, struct plotcol cols[], int ncol, double *ylo, double *yhi) {
+	struct plotcol *col;
+	double *y, *cx, *cy, xa, ya, t;
+	int i, i0, len, c, prev;
+
+	if (!(y = malloc ((PLOTBLOCK + 2 * ncol) * sizeof (double))))
+		return FIT_ERR_MEMORY;
+	cx = y + PLOTBLOCK;
+	cy = cx + ncol;
+
+	for (c = 0; c < ncol; c++) {
+		cols[c].n = 0;
+		cols[c].xsum = cols[c].ysum = 0;
+		cols[c].ymin = cols[c].lo = DBL_MAX;
+		cols[c].ymax = cols[c].hi = -DBL_MAX;
+		cols[c].area = -1;
+		cols[c].best = -1;
+	}
+	*ylo = DBL_MAX;
+	*yhi = -DBL_MAX;
+
+	for (i0 = 0; i0 < d->n; i0 += PLOTBLOCK) {
+		len = d->n - i0 < PLOTBLOCK ? d->n - i0 : PLOTBLOCK;
+		BlockY (d, m, a, na, i0, len, y);
+		for (i = 0; i < len; i++) {
+			if (!isfinite (y[i]) || !isfinite (d->X[i0 + i]))
+				continue;
+			col = &cols[Column (p, ncol, d->X[i0 + i])];
+			col->n++;
+			col->xsum += d->X[i0 + i];
+			col->ysum += y[i];
+			if (y[i] < col->ymin)
+				col->ymin = y[i];
+			if (y[i] > col->ymax)
+				col->ymax = y[i];
+			t = fabs (d->dY[i0 + i]);
+			if (y[i] - t < col->lo)
+				col->lo = y[i] - t;
+			if (y[i] + t > col->hi)
+				col->hi = y[i] + t;
+		}
+	}
+	for (c = 0; c < ncol; c++)
+		if (cols[c].n) {
+			cx[c] = cols[c].xsum / cols[c].n;
+			cy[c] = cols[c].ysum / cols[c].n;
+			if (cols[c].lo < *ylo)
+				*ylo = cols[c].lo;
+			if (cols[c].hi > *yhi)
+				*yhi = cols[c].hi;
+		}
+
+	// Neighbour centroids, of the nearest non-empty columns (the column's own at the ends):
+	// the left one goes to cols[c].xsum / ysum, the right one replaces cx[c] / cy[c].
+	for (c = 0, prev = -1; c < ncol; c++) {
+		if (!cols[c].n)
+			continue;
+		cols[c].xsum = cx[prev < 0 ? c : prev];
+		cols[c].ysum = cy[prev < 0 ? c : prev];
+		if (prev >= 0) {
+			cx[prev] = cx[c];
+			cy[prev] = cy[c];
+		}
+		prev = c;
+	}
+
+	for (i0 = 0; i0 < d->n; i0 += PLOTBLOCK) {
+		len = d->n - i0 < PLOTBLOCK ? d->n - i0 : PLOTBLOCK;
+		BlockY (d, m, a, na, i0, len, y);
+		for (i = 0; i < len; i++) {
+			if (!isfinite (y[i]) || !isfinite (d->X[i0 + i]))
+				continue;
+			c = Column (p, ncol, d->X[i0 + i]);
+			xa = cols[c].xsum;
+			ya = cols[c].ysum;
+			t = fabs ((xa - cx[c]) * (y[i] - ya) - (xa - d->X[i0 + i]) * (cy[c] - ya));
+			if (t > cols[c].area) {
+				cols[c].area = t;
+				cols[c].best = i0 + i;
+			}
+		}
+	}
+
+	free (y);
+	return FIT_OK;
+}
+
+static void ErrorBars (FILE *f, const struct panel *p, double x, double dx, double y, double dy) {
+
+	fprintf (f, "<path d=\"M%.1f %.1fV%.1fM%.1f %.1fH%.1f\"/>\n",
+			 PX (p, x), PY (p, y - dy), PY (p, y + dy), PX (p, x - dx), PY (p, y), PX (p, x + dx));
+}
+
+static void Marker (FILE *f, const struct panel *p, double x, double y) {
+
+	fprintf (f, "<rect x=\"%.1f\" y=\"%.1f\" width=\"3\" height=\"3\"/>\n", PX (p, x) - 1.5, PY (p, y) - 1.5);
+}
+
+// Draws the points (or residuals) of d with their error bars. With more than PLOTALL points
+// per pixel column, every column is drawn as the extent of its error bars, the extent of its
+// points, and its LTTB point with error bars.
+static int Points (FILE *f, const struct panel *p, const struct dataset *d, const struct fitmodel *m,
+				   double a[], int na, const struct plotcol cols[], int ncol) {
+	double y[PLOTBLOCK], x;
+	int i, i0, len, c, k;
+
+	fprintf (f, "<g clip-path=\"url(#clip%d)\" fill=\"%s\" stroke=\"%s\" stroke-width=\"1\">\n",
+			 p->id, COLOR_DATA, COLOR_DATA);
+
+	if (d->n <= PLOTALL * ncol) {
+		for (i0 = 0; i0 < d->n; i0 += PLOTBLOCK) {
+			len = d->n - i0 < PLOTBLOCK ? d->n - i0 : PLOTBLOCK;
+			BlockY (d, m, a, na, i0, len, y);
+			for (i = 0; i < len; i++)
+				if (isfinite (y[i]) && isfinite (d->X[i0 + i])) {
+					ErrorBars (f, p, d->X[i0 + i], d->dX[i0 + i], y[i], d->dY[i0 + i]);
+					Marker (f, p, d->X[i0 + i], y[i]);
+				}
+		}
+	}
+
+	else
+		for (c = 0; c < ncol; c++) {
+			if (!cols[c].n)
+				continue;
+			x = p->left + c + 0.5;
+			fprintf (f, "<path d=\"M%.1f %.1fV%.1f\" stroke-opacity=\"0.3\"/>\n", x, PY (p, cols[c].lo),
+					 PY (p, cols[c].hi));
+			fprintf (f, "<path d=\"M%.1f %.1fV%.1f\"/>\n", x, PY (p, cols[c].ymin), PY (p, cols[c].ymax));
+			if ((k = cols[c].best) >= 0) {
+				BlockY (d, m, a, na, k, 1, y);
+				ErrorBars (f, p, d->X[k], d->dX[k], y[0], d->dY[k]);
+				Marker (f, p, d->X[k], y[0]);
+			}
+		}
+
+	fprintf (f, "</g>\n");
+	return FIT_OK;
+}
+
+// Draws the model with parameters a as a line, sampled for the size of the graph.
+static int Curve (FILE *f, const struct panel *p, const struct fitmodel *m, double a[], int na, const char *color) {
+	double *X;
+	int i, n, pen = 0;
+
+	if (!(X = malloc (2 * PLOTCURVE * sizeof (double))))
+		return FIT_ERR_MEMORY;
+	n = SampleModel (m, a, na, p->xmin, p->xmax, (int)p->width, 0.5 * (p->ymax - p->ymin) / p->height,
+					 X, X + PLOTCURVE, PLOTCURVE);
+
+	fprintf (f, "<path clip-path=\"url(#clip%d)\" fill=\"none\" stroke=\"%s\" stroke-width=\"1.5\" d=\"",
+			 p->id, color);
+	for (i = 0; i < n; i++)
+		if (!isfinite (X[PLOTCURVE + i]))
+			pen = 0;						// Lift the pen where the model isn't defined.
+		else {
+			fprintf (f, "%c%.2f %.2f", pen ? 'L' : 'M', PX (p, X[i]), PY (p, X[PLOTCURVE + i]));
+			pen = 1;
+		}
+	fprintf (f, "\"/>\n");
+
+	free (X);
+	return n < 0 ? n : FIT_OK;
+}
+
+// Tick spacing of about PLOTTICKS ticks over [lo, hi]: 1, 2 or 5 times a power of 10.
+static double TickStep (double lo, double hi) {
+	double raw = (hi - lo) / PLOTTICKS, mag = pow (10, floor (log10 (raw))), r = raw / mag;
+
+	return mag * (r < 1.5 ? 1 : r < 3.5 ? 2 : r < 7.5 ? 5 : 10);
+}
+
+// Ticks over [lo, hi]: tick k of the n returned is at (*k0 + k) * *step. None where the step is
+// too small to tell ticks apart at the magnitude of the values (e.g. 1e17 + 5), or not finite.
+static int Ticks (double lo, double hi, double *step, double *k0) {
+	double k1, mag = fabs (lo) > fabs (hi) ? fabs (lo) : fabs (hi);
+
+	*step = TickStep (lo, hi);
+	if (!(*step > 0 && *step < DBL_MAX) || *step < 16 * DBL_EPSILON * mag)
+		return 0;
+	*k0 = ceil (lo / *step);
+	k1 = floor (hi / *step);
+	if (!(k1 >= *k0))
+		return 0;
+
+	return k1 - *k0 < PLOTMAXTICKS ? (int)(k1 - *k0) + 1 : PLOTMAXTICKS;
+}
+
+// Draws the frame, ticks and tick labels of a graph, and its clip path.
+static void Axes (FILE *f, const struct panel *p) {
+	double step, k0, t, px;
+	int k, n;
+
+	fprintf (f, "<clipPath id=\"clip%d\"><rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%.1f\"/></clipPath>\n",
+			 p->id, p->left, p->top, p->width, p->height);
+	fprintf (f, "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%.1f\" fill=\"none\" stroke=\"#000\"/>\n",
+			 p->left, p->top, p->width, p->height);
+
+	n = Ticks (p->xmin, p->xmax, &step, &k0);
+	for (k = 0; k < n; k++) {
+		t = (k0 + k) * step;
+		px = PX (p, t);
+		fprintf (f, "<path d=\"M%.1f %.1fv-5\" stroke=\"#000\"/>"
+				 "<text x=\"%.1f\" y=\"%.1f\" text-anchor=\"middle\">%g</text>\n",
+				 px, p->top + p->height, px, p->top + p->height + 16, fabs (t) < step * 1e-9 ? 0 : t);
+	}
+
+	n = Ticks (p->ymin, p->ymax, &step, &k0);
+	for (k = 0; k < n; k++) {
+		t = (k0 + k) * step;
+		px = PY (p, t);
+		fprintf (f, "<path d=\"M%.1f %.1fh5\" stroke=\"#000\"/>"
+				 "<text x=\"%.1f\" y=\"%.1f\" text-anchor=\"end\">%g</text>\n",
+				 p->left, px, p->left - 6, px + 4, fabs (t) < step * 1e-9 ? 0 : t);
+	}
+}
+
+static void YLabel (FILE *f, const struct panel *p, const char *label) {
+
+	fprintf (f, "<text transform=\"translate(16 %.1f) rotate(-90)\" text-anchor=\"middle\">",
+			 p->top + p->height / 2);
+	PutText (f, label);
+	fprintf (f, "</text>\n");
+}
+
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Renders the data of spec, with error bars, the fitted and initial functions and
+/// HIFN  the residuals (each if set in spec) to an SVG file, laid out like the GUI graphs.
+/// HIFN  Any no. of points takes time linear in it and a file of bounded size: beyond a
+/// HIFN  couple of points per pixel column, the points of a column are drawn as their extent
+/// HIFN  and a representative point (largest triangle with the neighbour columns, as LTTB).
+/// HIRET FIT_OK, FIT_ERR_ARGS, FIT_ERR_FILE or FIT_ERR_MEMORY.
+
+int WritePlotSvg (const char *path, const struct plotspec *spec) {
+	const struct dataset *d = spec->data;
+	const struct fitmodel *m = spec->model;
+	struct panel gp, rp;
+	struct plotcol *cols;
+	double fita[MAXPAR], inita[MAXPAR], lo, hi;
+	int i, ncol, na = spec->na, residuals, status = FIT_OK;
+	FILE *f;
+
+	if (!d || d->n < 1 || spec->width < PLOTLEFT + PLOTRIGHT + 50 || spec->height < PLOTTOP + PLOTBOTTOM + 50
+		|| ((spec->fita || spec->inita) && (!m || na < 1 || na > MAXPAR)))
+		return FIT_ERR_ARGS;
+	if (spec->fita)
+		memcpy (fita, spec->fita, na * sizeof (double));
+	if (spec->inita)
+		memcpy (inita, spec->inita, na * sizeof (double));
+	residuals = spec->residuals && spec->fita;
+
+	// Layout.
+	gp.id = 0;
+	gp.left = PLOTLEFT;
+	gp.top = PLOTTOP;
+	gp.width = spec->width - PLOTLEFT - PLOTRIGHT;
+	gp.height = spec->height - PLOTTOP - PLOTBOTTOM;
+	if (residuals) {
+		rp = gp;
+		rp.id = 1;
+		gp.height = floor ((gp.height - PLOTGAP) * (1 - PLOTRESFRAC));
+		rp.height -= gp.height + PLOTGAP;
+		rp.top = gp.top + gp.height + PLOTGAP;
+	}
+
+	// X range of the data with their error bars.
+	gp.xmin = DBL_MAX;
+	gp.xmax = -DBL_MAX;
+	for (i = 0; i < d->n; i++)
+		if (isfinite (d->X[i]) && isfinite (d->dX[i])) {
+			if (d->X[i] - fabs (d->dX[i]) < gp.xmin)
+				gp.xmin = d->X[i] - fabs (d->dX[i]);
+			if (d->X[i] + fabs (d->dX[i]) > gp.xmax)
+				gp.xmax = d->X[i] + fabs (d->dX[i]);
+		}
+	Pad (&gp.xmin, &gp.xmax);
+	rp.xmin = gp.xmin;
+	rp.xmax = gp.xmax;
+
+	ncol = (int)gp.width;
+	if (!(cols = malloc (ncol * sizeof (struct plotcol))))
+		return FIT_ERR_MEMORY;
+	if (!(f = fopen (path, "w"))) {
+		free (cols);
+		return FIT_ERR_FILE;
+	}
+
+	fprintf (f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			 "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" "
+			 "font-family=\"sans-serif\" font-size=\"12\">\n"
+			 "<rect width=\"100%%\" height=\"100%%\" fill=\"#fff\"/>\n",
+			 spec->width, spec->height, spec->width, spec->height);
+	fprintf (f, "<text x=\"%.1f\" y=\"24\" text-anchor=\"middle\" font-size=\"16\">", gp.left + gp.width / 2);
+	PutText (f, spec->title);
+	fprintf (f, "</text>\n");
+
+	// Data and functions.
+	if ((status = Aggregate (d, NULL, NULL, 0, &gp, cols, ncol, &lo, &hi)) == FIT_OK) {
+		gp.ymin = lo;
+		gp.ymax = hi;
+		Pad (&gp.ymin, &gp.ymax);
+		Axes (f, &gp);
+		YLabel (f, &gp, spec->ylabel);
+		status = Points (f, &gp, d, NULL, NULL, 0, cols, ncol);
+	}
+	if (status == FIT_OK && spec->inita)
+		status = Curve (f, &gp, m, inita, na, COLOR_INIT);
+	if (status == FIT_OK && spec->fita)
+		status = Curve (f, &gp, m, fita, na, COLOR_FIT);
+
+	// Residuals, about a zero line.
+	if (status == FIT_OK && residuals && (status = Aggregate (d, m, fita, na, &rp, cols, ncol, &lo, &hi)) == FIT_OK) {
+		// No finite residual (the model undefined at every point) leaves an empty range for Pad.
+		hi = !(lo <= hi) ? 0 : fabs (lo) > fabs (hi) ? fabs (lo) : fabs (hi);
+		rp.ymin = -hi;
+		rp.ymax = hi;
+		Pad (&rp.ymin, &rp.ymax);
+		Axes (f, &rp);
+		YLabel (f, &rp, "Residuals");
+		fprintf (f, "<path d=\"M%.1f %.1fH%.1f\" stroke=\"%s\"/>\n", rp.left, PY (&rp, 0), rp.left + rp.width,
+				 COLOR_ZERO);
+		status = Points (f, &rp, d, m, fita, na, cols, ncol);
+	}
+
+	fprintf (f, "<text x=\"%.1f\" y=\"%d\" text-anchor=\"middle\">", gp.left + gp.width / 2, spec->height - 12);
+	PutText (f, spec->xlabel);
+	fprintf (f, "</text>\n</svg>\n");
+
+	if (fclose (f) && status == FIT_OK)
+		status = FIT_ERR_FILE;
+	free (cols);
+	return status;
+}
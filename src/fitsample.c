@@ -0,0 +1,140 @@
+//==============================================================================
+//
+// Title:		fitsample.c
+// Purpose:		Sampling of a fitted model for plotting: points are spread by
+//				the curve's shape on the plot, not uniformly, so that few
+//				evaluations draw it smoothly.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Constants
+
+#define SAMPLEGRID		4		// Pixels between the points of the first, uniform pass.
+#define SAMPLESUBPIX	4		// Segments are never split below 1 / SAMPLESUBPIX pixel.
+
+//==============================================================================
+// Static functions
+
+static int CompareDesc (const void *p, const void *q) {
+	double a = *(const double *)p, b = *(const double *)q;
+
+	return (a < b) - (a > b);
+}
+
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Samples the model on [xmin, xmax] for a plot npix pixels wide. A uniform grid every
+/// HIFN  few pixels is refined where the curve bends: a segment is split in two while its
+/// HIFN  midpoint is more than ytol (in Y units, typically half a pixel) off the chord, down
+/// HIFN  to a fraction of a pixel. Where maxpts runs out, the most curved segments go first.
+/// HIPAR X/Receives the sampled X values, in ascending order. Room for maxpts.
+/// HIPAR Y/Receives the model values at X.
+/// HIRET No. of points (2 to maxpts), or FIT_ERR_ARGS or FIT_ERR_MEMORY (< 0).
+
+int SampleModel (const struct fitmodel *m, double a[], int na, double xmin, double xmax, int npix, double ytol,
+				 double X[], double Y[], int maxpts) {
+	double *xm, *ym, *err, *sorted, dxmin, e, thr;
+	int *seg, i, j, k, n, nsplit, pos;
+	char *active, *split;
+
+	if (!m || !(xmin < xmax) || npix < 1 || !(ytol > 0) || maxpts < 2)
+		return FIT_ERR_ARGS;
+
+	// Midpoints, their values, errors and segments, and 2 flags per point.
+	xm = malloc ((size_t)maxpts * (4 * sizeof (double) + sizeof (int) + 2));
+	if (!xm)
+		return FIT_ERR_MEMORY;
+	ym = xm + maxpts;
+	err = ym + maxpts;
+	sorted = err + maxpts;
+	seg = (int *)(sorted + maxpts);
+	active = (char *)(seg + maxpts);			// Segment from point i still being refined.
+	split = active + maxpts;
+
+	// First pass: uniform.
+	n = npix / SAMPLEGRID + 1;
+	if (n < 2)
+		n = 2;
+	if (n > maxpts)
+		n = maxpts;
+	for (i = 0; i < n; i++) {
+		X[i] = xmin + (xmax - xmin) * i / (n - 1);
+		active[i] = 1;
+	}
+	ModelEvalArray (m, X, Y, n, a, na);
+	dxmin = (xmax - xmin) / ((double)npix * SAMPLESUBPIX);
+
+	while (n < maxpts) {
+		// Midpoints of the segments still being refined.
+		for (i = k = 0; i < n - 1; i++)
+			if (active[i] && X[i + 1] - X[i] > dxmin) {
+				seg[k] = i;
+				xm[k++] = 0.5 * (X[i] + X[i + 1]);
+			}
+			else
+				active[i] = 0;
+		if (!k)
+			break;
+		ModelEvalArray (m, xm, ym, k, a, na);
+
+		// Segments whose chord is off the curve get split, the others are done.
+		for (j = nsplit = 0; j < k; j++) {
+			e = fabs (ym[j] - 0.5 * (Y[seg[j]] + Y[seg[j] + 1]));
+			split[j] = e > ytol;					// Not where the model is NaN.
+			err[j] = e;
+			if (split[j])
+				sorted[nsplit++] = e;
+			else
+				active[seg[j]] = 0;
+		}
+		if (!nsplit)
+			break;
+
+		// Short of room: keep the worst segments.
+		if (n + nsplit > maxpts) {
+			qsort (sorted, nsplit, sizeof (double), CompareDesc);
+			thr = sorted[maxpts - n - 1];
+			for (j = nsplit = 0; j < k; j++)
+				if (split[j] && (err[j] < thr || n + nsplit == maxpts))
+					split[j] = 0;
+				else if (split[j])
+					nsplit++;
+			if (!nsplit)
+				break;
+		}
+
+		// Insert the midpoints, from the end so that nothing is overwritten before it's moved.
+		pos = n - 1 + nsplit;
+		for (i = n - 1, j = k - 1; i >= 0; i--) {
+			while (j >= 0 && seg[j] > i)
+				j--;
+			if (j >= 0 && seg[j] == i && split[j]) {
+				X[pos] = xm[j];
+				Y[pos] = ym[j];
+				active[pos--] = 1;
+			}
+			X[pos] = X[i];
+			Y[pos] = Y[i];
+			active[pos--] = active[i];
+		}
+		n += nsplit;
+	}
+
+	free (xm);
+	return n;
+}
@@ -0,0 +1,171 @@
+//==============================================================================
+//
+// Title:		fitsession.c
+// Purpose:		Live fitting of data acquired point by point: an append-only
+//				dataset refitted at a fixed cadence, each fit warm started from
+//				the previous one, so a refit takes a few iterations instead of
+//				a full fit from the initial guess.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <limits.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Static functions
+
+// Refits after an append if the cadence is reached, and returns the error of the refit if any
+// (the points stay appended). The status of the fit itself is left in s->fit.status.
+static int CadenceRefit (struct fitsession *s) {
+
+	if (s->cadence > 0 && s->pending >= s->cadence && s->data.n >= s->na)
+		return FitSessionRefit (s);
+	return FIT_OK;
+}
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Starts a live fit of model to an empty dataset. s needn't be initialized.
+/// HIPAR inita/Parameters to start the first fit (and any fit after a failed one) from. NULL for
+/// HIPAR inita/InitialGuess, which only knows the built-in models: required for the others.
+/// HIPAR na/No. of parameters (the model's, or the polynomial degree + 1 for POLY).
+/// HIPAR opt/Fit options, see FitDefaultOptions. NULL for the defaults.
+/// HIPAR cadence/Refit every cadence appended points. 0 to refit only on FitSessionRefit.
+/// HIPAR window/Fit only the last window points (e.g. to follow a drift). 0 to fit all of them.
+/// HIRET FIT_OK or FIT_ERR_ARGS.
+
+int FitSessionInit (struct fitsession *s, const struct fitmodel *model, const double inita[], int na,
+					const struct fitoptions *opt, int cadence, int window) {
+
+	memset (s, 0, sizeof (*s));
+	if (!model || na < 1 || na > MAXPAR || (model->na && na != model->na) || cadence < 0 || window < 0
+		|| (window && window < na) || (!inita && GetFitModel (model->type) != model))
+		return FIT_ERR_ARGS;
+
+	s->model = model;
+	s->na = na;
+	if (inita) {
+		s->hasinita = 1;
+		memcpy (s->inita, inita, na * sizeof (double));
+	}
+	if (opt)
+		s->opt = *opt;
+	else
+		FitDefaultOptions (&s->opt);
+	s->opt.warm = NULL;
+	s->cadence = cadence;
+	s->window = window;
+
+	return FIT_OK;
+}
+
+/// HIFN  Appends a point, and refits if cadence points were appended since the last fit.
+/// HIRET FIT_OK, FIT_ERR_MEMORY, or the error of the refit (see FitSessionRefit), after which the
+/// HIRET point is still appended. The status of the fit is in s->fit.status.
+
+int FitSessionAppend (struct fitsession *s, double x, double dx, double y, double dy) {
+	int status;
+
+	if ((status = DatasetAppend (&s->data, x, dx, y, dy)) < 0)
+		return status;
+	s->pending++;
+
+	return CadenceRefit (s);
+}
+
+/// HIFN  Appends n points at once (e.g. a readout of the instrument), then refits at most
+/// HIFN  once if the cadence was reached.
+/// HIRET FIT_OK, FIT_ERR_MEMORY, or the error of the refit (see FitSessionRefit), after which the
+/// HIRET points are still appended. The status of the fit is in s->fit.status.
+
+int FitSessionAppendBlock (struct fitsession *s, double X[], double dX[], double Y[], double dY[], int n) {
+	int i, status, cap;
+
+	if (n <= 0)
+		return FIT_OK;
+
+	// Grow by doubling, as single appends do, to keep appends amortized O(1).
+	if (s->data.n > INT_MAX - n)
+		return FIT_ERR_MEMORY;
+	for (cap = s->data.cap ? s->data.cap : n; cap < s->data.n + n; )
+		cap = cap > INT_MAX / 2 ? INT_MAX : 2 * cap;
+	if ((status = DatasetReserve (&s->data, cap)) < 0)
+		return status;
+
+	for (i = 0; i < n; i++) {
+		s->data.X[s->data.n + i] = X[i];
+		s->data.dX[s->data.n + i] = dX[i];
+		s->data.Y[s->data.n + i] = Y[i];
+		s->data.dY[s->data.n + i] = dY[i];
+	}
+	s->data.n += n;
+	s->pending += n;
+
+	return CadenceRefit (s);
+}
+
+/// HIFN  Fits the model to the points (the last window ones if set) now. The first fit, and
+/// HIFN  any fit after a failed one, starts from the session's inita or InitialGuess; later
+/// HIFN  ones from the last fit.
+/// HIRET FIT_OK, or the error of the workspace or the initial guess. The status of the fit
+/// HIRET itself is in s->fit.status.
+
+int FitSessionRefit (struct fitsession *s) {
+	double a[MAXPAR], tguess = 0;
+	int status, i0 = 0, n = s->data.n;
+	struct fitparameters fit;
+
+	if (n < s->na)
+		return FIT_ERR_ARGS;
+	if (s->window && n > s->window) {
+		i0 = n - s->window;
+		n = s->window;
+	}
+
+	// Appends may have moved the data: rebind it every time (no allocation once ws is big enough).
+	status = FitWorkspaceInit (&s->ws, s->data.X + i0, s->data.dX + i0, s->data.Y + i0, s->data.dY + i0, n);
+	if (status < 0)
+		return status;
+
+	if (s->nfits > 0 && s->fit.status >= 0)
+		s->opt.warm = &s->fit;
+	else if (s->hasinita) {
+		s->opt.warm = NULL;
+		memcpy (a, s->inita, s->na * sizeof (double));
+	}
+	else {
+		s->opt.warm = NULL;
+		tguess = FitClock ();
+		status = InitialGuess (s->model->type, s->ws.X, s->ws.Y, s->ws.dY, n, a, s->na);
+		tguess = FitClock () - tguess;
+		if (status < 0)
+			return status;
+	}
+
+	fit = GeneralFitWs (s->model, &s->ws, a, s->na, &s->opt);
+	fit.stats.tguess = tguess;
+	s->opt.warm = NULL;
+	s->fit = fit;
+	s->nfits++;
+	s->pending = 0;
+
+	return FIT_OK;
+}
+
+// Frees the dataset and buffers of s.
+void FitSessionFree (struct fitsession *s) {
+
+	DatasetFree (&s->data);
+	FitWorkspaceFree (&s->ws);
+	memset (s, 0, sizeof (*s));
+}
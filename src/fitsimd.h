@@ -0,0 +1,152 @@
+//==============================================================================
+//
+// Title:		fitsimd.h
+// Purpose:		Branch-free exp and log for the array kernels of the fit
+//				functions. Loops calling them are vectorized by the compiler,
+//				and SIMD_CLONES builds SSE2, SSE4.2, AVX2 and AVX-512 versions of such
+//				loops, picked at run time by the CPU.
+//
+//				Accuracy: VecExp and VecLog are within 1 ulp of the C library
+//				exp and log, VecLog10 within 2 ulp. Arguments they can't
+//				handle (exp overflow/underflow, log of x <= 0, subnormal,
+//				infinite or NaN x) are left for the caller to pass to the C
+//				library (see ExpInRange, LogInRange).
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+#ifndef __fitsimd_H__
+#define __fitsimd_H__
+
+
+//==============================================================================
+// Include files
+
+#include <stdint.h>
+#include <string.h>
+
+
+//==============================================================================
+// Constants
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+	#define SIMD_CLONES		__attribute__ ((target_clones ("avx512f", "avx2", "sse4.2", "default")))
+#else
+	#define SIMD_CLONES
+#endif
+
+// The helpers below must be inlined into each clone for its loops to vectorize.
+#if defined(__GNUC__)
+	#define SIMD_INLINE		static inline __attribute__ ((always_inline))
+#else
+	#define SIMD_INLINE		static inline
+#endif
+
+#define SIMD_BLOCK		256			// No. of points evaluated together by the array kernels.
+
+#define EXP_MIN			-708.0		// exp (x) is normal for EXP_MIN <= x <= EXP_MAX.
+#define EXP_MAX			709.0
+#define LN2_HI			6.93147180369123816490e-01
+#define LN2_LO			1.90821492927058770002e-10
+#define LOG2E			1.44269504088896338700e+00
+#define LOG10E			4.34294481903251816668e-01
+#define LOG10_2			3.01029995663981198017e-01
+#define SQRT2			1.41421356237309514547e+00
+#define ROUND_MAGIC		6755399441055744.0			// 1.5 * 2^52, rounds to an integer when added.
+
+
+//==============================================================================
+// Static functions
+
+SIMD_INLINE uint64_t DoubleBits (double x) {
+	uint64_t u;
+	memcpy (&u, &x, sizeof (u));
+	return u;
+}
+
+SIMD_INLINE double BitsDouble (uint64_t u) {
+	double x;
+	memcpy (&x, &u, sizeof (x));
+	return x;
+}
+
+SIMD_INLINE int ExpInRange (double x) {
+	return x >= EXP_MIN && x <= EXP_MAX;
+}
+
+SIMD_INLINE int LogInRange (double x) {
+	return x >= 2.2250738585072014e-308 && x <= 1.7976931348623157e+308;
+}
+
+// exp (x) for EXP_MIN <= x <= EXP_MAX, meaningless outside: x = k ln2 + r with |r| <= ln2 / 2,
+// and exp (r) by its Taylor series to r^13.
+SIMD_INLINE double VecExp (double x) {
+	double t, k, r, p;
+
+	t = x * LOG2E + ROUND_MAGIC;
+	k = t - ROUND_MAGIC;
+	r = (x - k * LN2_HI) - k * LN2_LO;
+
+	p = 1.0 / 6227020800.0;
+	p = p * r + 1.0 / 479001600.0;
+	p = p * r + 1.0 / 39916800.0;
+	p = p * r + 1.0 / 3628800.0;
+	p = p * r + 1.0 / 362880.0;
+	p = p * r + 1.0 / 40320.0;
+	p = p * r + 1.0 / 5040.0;
+	p = p * r + 1.0 / 720.0;
+	p = p * r + 1.0 / 120.0;
+	p = p * r + 1.0 / 24.0;
+	p = p * r + 1.0 / 6.0;
+	p = p * r + 0.5;
+	p = p * r * r + r;
+
+	// 2^k from the low bits of t.
+	return (1.0 + p) * BitsDouble ((DoubleBits (t) << 52) + DoubleBits (1.0));
+}
+
+// Natural log of a normal, positive x: x = 2^e m with sqrt(1/2) <= m < sqrt(2), and
+// log (m) = 2 atanh (s) with s = (m - 1) / (m + 1), by its series to s^21.
+SIMD_INLINE double VecLogParts (double x, double *e) {
+	uint64_t u = DoubleBits (x), mant = u & 0x000fffffffffffffULL, big;
+	double m, f, s, z, p;
+
+	// Integer compare and select: floating point ones would keep the loop from vectorizing.
+	big = mant > 0x0006a09e667f3bcdULL;
+	m = BitsDouble (mant | (DoubleBits (1.0) - (big << 52)));
+	*e = BitsDouble (0x4330000000000000ULL | ((u >> 52) + big)) - 4503599627370496.0 - 1023;
+
+	f = m - 1;
+	s = f / (2 + f);
+	z = s * s;
+	p = 1.0 / 21;
+	p = p * z + 1.0 / 19;
+	p = p * z + 1.0 / 17;
+	p = p * z + 1.0 / 15;
+	p = p * z + 1.0 / 13;
+	p = p * z + 1.0 / 11;
+	p = p * z + 1.0 / 9;
+	p = p * z + 1.0 / 7;
+	p = p * z + 1.0 / 5;
+	p = p * z + 1.0 / 3;
+
+	// log (m) = f - f^2 / 2 + s (f^2 / 2 + 2 z p), which keeps the leading terms exact.
+	return f - (0.5 * f * f - s * (0.5 * f * f + 2 * z * p));
+}
+
+SIMD_INLINE double VecLog (double x) {
+	double e, lm = VecLogParts (x, &e);
+
+	return e * LN2_HI + (lm + e * LN2_LO);
+}
+
+SIMD_INLINE double VecLog10 (double x) {
+	double e, lm = VecLogParts (x, &e);
+
+	return e * LOG10_2 + lm * LOG10E;
+}
+
+
+#endif  /* ndef __fitsimd_H__ */
@@ -0,0 +1,270 @@
+//==============================================================================
+//
+// Title:		fitthread.c
+// Purpose:		Minimal portable threading (POSIX threads or Win32) for the
+//				fitting library: runs independent tasks on a pool of threads.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <pthread.h>
+	#include <time.h>
+	#include <unistd.h>
+#endif
+
+#include "fitthread.h"
+
+
+//==============================================================================
+// Constants
+
+#define MAXTHREADS		256
+
+#if defined(_MSC_VER)
+	#define THREADLOCAL		__declspec(thread)
+#else
+	#define THREADLOCAL		__thread
+#endif
+
+//==============================================================================
+// Types
+
+#ifdef _WIN32
+	typedef CONDITION_VARIABLE poolcond;
+#else
+	typedef pthread_cond_t poolcond;
+#endif
+
+// A FitParallelFor call waiting in the pool: items are claimed in order under the pool's lock.
+struct parfor {
+	fittask task;
+	void *arg;
+	int n;
+	int next;						// Next item to claim...
+	int done;						// ...and the no. finished.
+	int helpers;					// Pool threads working on it now...
+	int maxhelpers;					// ...and at most, from the nthreads option.
+	struct parfor *nextjob;
+};
+
+//==============================================================================
+// Static global variables
+
+static THREADLOCAL int inworker;		// Set in the pool threads and in FitParallelFor tasks.
+
+// The pool: threads started on demand, never stopped, waiting on workcond for calls in jobs.
+// Callers wait on donecond for the pool threads to leave their call.
+#ifdef _WIN32
+static SRWLOCK poollock = SRWLOCK_INIT;
+static poolcond workcond = CONDITION_VARIABLE_INIT, donecond = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static poolcond workcond = PTHREAD_COND_INITIALIZER, donecond = PTHREAD_COND_INITIALIZER;
+#endif
+static int nworkers;
+static struct parfor *jobs;
+
+//==============================================================================
+// Static functions
+
+static void PoolLock (void) {
+#ifdef _WIN32
+	AcquireSRWLockExclusive (&poollock);
+#else
+	pthread_mutex_lock (&poollock);
+#endif
+}
+
+static void PoolUnlock (void) {
+#ifdef _WIN32
+	ReleaseSRWLockExclusive (&poollock);
+#else
+	pthread_mutex_unlock (&poollock);
+#endif
+}
+
+// Waits for c to be signalled, with the lock held.
+static void PoolWait (poolcond *c) {
+#ifdef _WIN32
+	SleepConditionVariableSRW (c, &poollock, INFINITE, 0);
+#else
+	pthread_cond_wait (c, &poollock);
+#endif
+}
+
+static void PoolWakeAll (poolcond *c) {
+#ifdef _WIN32
+	WakeAllConditionVariable (c);
+#else
+	pthread_cond_broadcast (c);
+#endif
+}
+
+// Runs items of pf until none are left to claim. Called with the lock held, returns with it held.
+static void RunItems (struct parfor *pf) {
+	int i, wasworker = inworker;
+
+	inworker = 1;
+	while ((i = pf->next) < pf->n) {
+		pf->next++;
+		PoolUnlock ();
+		pf->task (pf->arg, i);
+		PoolLock ();
+		pf->done++;
+	}
+	inworker = wasworker;
+}
+
+// Pool thread: helps the first call that has items left and room for one more thread.
+static void PoolThread (void) {
+	struct parfor *pf;
+
+	inworker = 1;
+	PoolLock ();
+	for (;;) {
+		for (pf = jobs; pf && (pf->next >= pf->n || pf->helpers >= pf->maxhelpers); pf = pf->nextjob)
+			;
+		if (!pf) {
+			PoolWait (&workcond);
+			continue;
+		}
+		pf->helpers++;
+		RunItems (pf);
+		if (!--pf->helpers && pf->done == pf->n)
+			PoolWakeAll (&donecond);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI WorkerMain (LPVOID arg) {
+	(void)arg;
+	PoolThread ();
+	return 0;
+}
+#else
+static void *WorkerMain (void *arg) {
+	(void)arg;
+	PoolThread ();
+	return NULL;
+}
+#endif
+
+// Starts pool threads up to n, as far as the system allows. Called with the lock held.
+static void GrowPool (int n) {
+#ifdef _WIN32
+	HANDLE th;
+#else
+	pthread_t th;
+#endif
+
+	while (nworkers < n) {
+#ifdef _WIN32
+		if (!(th = CreateThread (NULL, 0, WorkerMain, NULL, 0, NULL)))
+			return;
+		CloseHandle (th);
+#else
+		if (pthread_create (&th, NULL, WorkerMain, NULL) != 0)
+			return;
+		pthread_detach (th);
+#endif
+		nworkers++;
+	}
+}
+
+//==============================================================================
+// Global functions
+
+/// HIFN  Seconds from an arbitrary point, by a monotonic clock: to time fits.
+
+double FitClock (void) {
+#ifdef _WIN32
+	LARGE_INTEGER t, f;
+
+	QueryPerformanceCounter (&t);
+	QueryPerformanceFrequency (&f);
+	return (double)t.QuadPart / f.QuadPart;
+#else
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+// Returns the no. of online CPUs (at least 1).
+int FitCpuCount (void) {
+	long n;
+
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo (&si);
+	n = si.dwNumberOfProcessors;
+#else
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+	return n < 1 ? 1 : (n > MAXTHREADS ? MAXTHREADS : n);
+}
+
+// No. of threads FitParallelFor uses for n items, given the nthreads option (0 for one per CPU).
+// Calls from inside a FitParallelFor task run on their own thread only.
+int FitThreadCount (int nthreads, int n) {
+
+	if (inworker)
+		return 1;
+	if (nthreads <= 0)
+		nthreads = FitCpuCount ();
+	if (nthreads > MAXTHREADS)
+		nthreads = MAXTHREADS;
+
+	return nthreads < n ? nthreads : (n > 0 ? n : 1);
+}
+
+// Runs task (arg, i) for i = 0 .. n - 1 on up to nthreads threads, the calling one included,
+// and returns when all are done. The other threads come from a pool started on the first call
+// that needs them, so a call costs no thread creation. Items are handed out one at a time, so
+// uneven tasks balance. Several calls may run at once, from different threads. Runs serially
+// if threads can't be created.
+void FitParallelFor (int nthreads, int n, fittask task, void *arg) {
+	struct parfor pf, **p;
+	int i, nt = FitThreadCount (nthreads, n);
+
+	if (nt <= 1) {
+		for (i = 0; i < n; i++)
+			task (arg, i);
+		return;
+	}
+
+	pf.task = task;
+	pf.arg = arg;
+	pf.n = n;
+	pf.next = 0;
+	pf.done = 0;
+	pf.helpers = 0;
+	pf.maxhelpers = nt - 1;
+	pf.nextjob = NULL;
+
+	PoolLock ();
+	GrowPool (nt - 1);
+	for (p = &jobs; *p; p = &(*p)->nextjob)
+		;
+	*p = &pf;
+	PoolWakeAll (&workcond);
+
+	RunItems (&pf);
+	while (pf.done < pf.n || pf.helpers)
+		PoolWait (&donecond);
+
+	for (p = &jobs; *p != &pf; p = &(*p)->nextjob)
+		;
+	*p = pf.nextjob;
+	PoolUnlock ();
+}
@@ -0,0 +1,31 @@
+//==============================================================================
+//
+// Title:		fitthread.h
+// Purpose:		Minimal portable threading (POSIX threads or Win32) for the
+//				fitting library: runs independent tasks on a pool of threads.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+#ifndef __fitthread_H__
+#define __fitthread_H__
+
+
+//==============================================================================
+// Types
+
+// A task of FitParallelFor: runs item i of n. Must be safe to run concurrently for different i.
+typedef void (*fittask)(void *arg, int i);
+
+
+//==============================================================================
+// Global functions
+
+int FitCpuCount (void);
+int FitThreadCount (int nthreads, int n);
+void FitParallelFor (int nthreads, int n, fittask task, void *arg);
+
+
+#endif  /* ndef __fitthread_H__ */
@@ -11,32 +11,110 @@
 //==============================================================================
 // Include files
 
-#include "datafitheader.h"
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curvifit.h"
+#include "fitdual.h"
+#include "fitsimd.h"
+#include "fitthread.h"
 
 
 //==============================================================================
 // Constants
 
 #define STEPDOWN	0.1
-#define CHICUT		0.00001		// maximum differential allowed between successive chi sqr values 
+#define CHICUT		0.00001		// default maximum differential allowed between successive chi sqr values 
 #define MAXITER		1000000		// Max no. of iterations to minimize chisq.
+#define LMMAXITER	1000		// Max no. of Levenberg-Marquardt iterations.
+#define LAMBDA0		0.001		// Initial Levenberg-Marquardt damping.
+#define LAMBDAMAX	1e10		// Damping at which chi^2 is considered minimal.
+#define LINMAXITER	100			// Max no. of effective variance iterations of linear models.
+#define NECHUNKS	32			// Max no. of data chunks of NormalEquations, run concurrently,
+#define NEMINBLOCKS	64			// of at least this many blocks of SIMD_BLOCK points.
+#define MEMOSIZE	8			// No. of chi^2 values remembered by a fit.
+#define MSLMITER	5			// Iterations of every multi-start point before the weak ones are dropped:
+#define MSGRADITER	100			// LM and gradient line search steps.
+#define MSKEEP		4			// 1 / fraction of the multi-start points kept after the first stage.
+#define MSSPREAD	1.0			// Half width of the multi-start box, relative to the parameters.
 
 //==============================================================================
 // Types
 
-struct errors {
-	double *cov;
-	double *err;
-};
-
+// A line search of GradStep. It owns its buffers, so that fits can run concurrently.
 struct gradstep {
-	double *anew;
+	double anew[MAXPAR];
+	double grad[MAXPAR];
+	double gnorm;					// Norm of the chi^2 gradient at the start.
 	double stepsum;
-	double *grad;
-	int stopflag;
+	int stopflag;					// 1 at the iteration limit, 2 over budget, 3 if the gradient is undefined,
+									// 4 if it's zero (a is a minimum, or nothing can move).
 	int iter;
 };
 
+// When to stop a fit besides the iteration limit, from fitoptions.
+struct fitstop {
+	double atol;
+	double rtol;
+	double xtol;
+	double gtol;
+	double deadline;				// FitClock time to give up at, 0 for none.
+	long long maxeval;				// 0 for no limit.
+};
+
+// State of one fit: the model, the data and the last chi^2 values computed, so that
+// no parameter vector is evaluated twice (see Chi2 and Chi2Res).
+struct fitcontext {
+	const struct fitmodel *m;
+	struct fitworkspace *ws;
+	int na;
+	int nthreads;
+	int nmemo;						// No. of valid memo entries.
+	int memonext;					// Next memo entry to overwrite.
+	double memoa[MEMOSIZE][MAXPAR];
+	double memochi2[MEMOSIZE];
+	int hasres;						// 1 if ws->res and ws->sig are at resa.
+	double resa[MAXPAR];
+	struct fitstats stats;
+	struct fittrace *trace;			// Or NULL.
+	struct fitstop stop;
+};
+
+// A starting point of MultiStart.
+struct start {
+	double a[MAXPAR];
+	double chi2;
+	int iter;
+	struct fitstats stats;
+};
+
+// A MultiStart run, shared by the StartTask of every point.
+struct multistart {
+	const struct fitmodel *m;
+	struct fitworkspace *ws;		// Data and features, shared by all points.
+	int na;
+	int method;
+	int maxiter;					// Iterations of the current stage.
+	double *stepsize;
+	struct fitstop stop;			// Of every point, with a share of the evaluation budget.
+	struct start *starts;
+	int *run;						// Points run in the current stage.
+};
+
+// The sums of NormalEquations over chunks of the data, computed by NormalChunk.
+struct normaleq {
+	struct fitcontext *ctx;
+	const double *a;
+	const double *h;				// Parameter steps of the Jacobian.
+	int chunk;						// No. of points of a chunk.
+	double alpha[NECHUNKS][MAXPAR * MAXPAR];	// Lower triangles.
+	double beta[NECHUNKS][MAXPAR];
+};
+
 //==============================================================================
 // Static global variables
 
@@ -44,109 +122,391 @@ struct gradstep {
 //==============================================================================
 // Static functions
 
-static void FEvalArray (double (*func)(double, double *, int), double X[], double Y[], int n,
-						 double a[], int na);
-static struct gradstep GradStep (double (*func)(double, double *, int), double X[], double dX[], double Y[], double dY[],
-						int n, double a[], int na, double stepsize[], double stepdown, int iter);
-static double CalcChi2 (double (*func)(double, double *, int), double X[], double dX[], double Y[], double dY[],
-						int n, double a[], int na);
-static struct errors Errors (double (*func)(double, double *, int), double X[], double dX[], double Y[], double dY[], int n,
-			   double a[], int na, double stepsize[]);
+static struct gradstep GradStep (struct fitcontext *ctx, double a[], double stepsize[], double stepdown,
+								 int iter, int maxiter);
+static void NormalEquations (struct fitcontext *ctx, double a[], double alpha[], double beta[]);
+static void Errors (struct fitcontext *ctx, double a[], double err[], double cov[]);
 
 
+// Model descriptor of func: the built-in model if func is one of the fit functions,
+// so that its array kernel is used, otherwise func evaluated point by point.
+static struct fitmodel FuncModel (double (*func)(double, double *, int)) {
+	const struct fitmodel *builtin = FindFitModelFunc (func);
+	struct fitmodel model;
 
+	if (builtin)
+		return *builtin;
 
-// Runs func on every item of array inarray and returns array of evaluated values.
-static void FEvalArray (double (*func)(double, double *, int), double Xin[], double Yout[], int n,
-						 double a[], int na) {
+	memset (&model, 0, sizeof (model));
+	model.type = -1;
+	model.func = func;
+	return model;
+}
+
+// Binds ws to the data points without touching its buffers. Drops the cached features.
+static void BindData (struct fitworkspace *ws, double X[], double dX[], double Y[], double dY[], int n) {
 	int i;
-	for (i = 0; i < n; i++)
-		Yout[i] = func (Xin[i], a, na);
-	return;
+
+	ws->X = X;
+	ws->dX = dX;
+	ws->Y = Y;
+	ws->dY = dY;
+	ws->n = n;
+	ws->features = 0;
+	ws->hasdx = 0;
+	for (i = 0; i < n && !ws->hasdx; i++)
+		ws->hasdx = (dX[i] != 0);
 }
 
-// Calculates chi2 using input coefficients.
-// Formula: sum ( ( y - f(x) )^2 / ( dy^2 + ( ( f(x+dx) - f(x-dx) ) / 2 )^2 ) ).
-static double CalcChi2 (double (*func)(double, double *, int), double X[], double dX[], double Y[], double dY[],
-						int n, double a[], int na) {
-	double Xup[n], Xdwn[n], Xeval[n], Xupeval[n], Xdwneval[n], chi2 = 0;
+// Weighted residuals ( y - f(x) ) / sigma, where sigma^2 = dy^2 + (df/dx dx)^2 by the model's slope
+// kernel, or dy^2 + ( ( f(x+dx) - f(x-dx) ) / 2 )^2 without one, and sigma of the len <= SIMD_BLOCK
+// points from i0 of the data bound to ws: by the model's residual kernel, or else by evaluating it
+// on the whole block at once.
+static void ResidualBlock (const struct fitmodel *m, struct fitworkspace *ws, int i0, int len, double a[], int na,
+						   double r[], double s[]) {
+	double *X = ws->X + i0, *dX = ws->dX + i0, *Y = ws->Y + i0, *dY = ws->dY + i0;
+	double xs[SIMD_BLOCK], f[SIMD_BLOCK], fu[SIMD_BLOCK], fd[SIMD_BLOCK], fdx;
 	int i;
-	
-	Add1D (X, dX, n, Xup);
-	Sub1D (X, dX, n, Xdwn);
-	
-	for (i = 0; i < n; i++) {
-		Xeval[i] = func (X[i], a, na);
-		Xupeval[i] = func (Xup[i], a, na);
-		Xdwneval[i] = func (Xdwn[i], a, na);
+
+	if (m->residuals) {
+		m->residuals (m, ws, i0, len, a, na, r, s);
+		return;
 	}
-	
-	for (i = 0; i < n; i++) 
-		chi2 += (Y[i] - Xeval[i]) * (Y[i] - Xeval[i]) / ( dY[i] * dY[i] + (Xupeval[i] - Xdwneval[i]) * (Xupeval[i] - Xdwneval[i]) / 4 );
-	
+
+	if (!ws->hasdx || !m->slope)
+		ModelEvalArray (m, X, f, len, a, na);
+
+	if (!ws->hasdx) {
+		for (i = 0; i < len; i++) {
+			s[i] = dY[i];
+			r[i] = (Y[i] - f[i]) / s[i];
+		}
+		return;
+	}
+
+	if (m->slope) {
+		m->slope (m, X, f, fu, len, a, na);
+		for (i = 0; i < len; i++) {
+			fdx = fu[i] * dX[i];
+			s[i] = sqrt (dY[i] * dY[i] + fdx * fdx);
+			r[i] = (Y[i] - f[i]) / s[i];
+		}
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		xs[i] = X[i] + dX[i];
+	ModelEvalArray (m, xs, fu, len, a, na);
+	for (i = 0; i < len; i++)
+		xs[i] = X[i] - dX[i];
+	ModelEvalArray (m, xs, fd, len, a, na);
+
+	for (i = 0; i < len; i++) {
+		fdx = (fu[i] - fd[i]) / 2;
+		s[i] = sqrt (dY[i] * dY[i] + fdx * fdx);
+		r[i] = (Y[i] - f[i]) / s[i];
+	}
+}
+
+// 1 if the model has an exact Jacobian (see JacobianBlock). The dual fit function has no df/dx, so it
+// can't differentiate the sigmas of a model with a slope kernel.
+static int HasJacobian (const struct fitmodel *m) {
+
+	return m->jacobian || (m->dual && !m->slope);
+}
+
+// Weighted residuals r, sigmas s and their exact Jacobian J[j][i] = dr_i / da_j for the len points
+// from i0 of the data bound to ws: by the model's Jacobian kernel, or its dual fit function on each
+// point. Only reads ws.
+static void JacobianBlock (const struct fitmodel *m, struct fitworkspace *ws, int i0, int len, double a[],
+						   int na, double r[], double s[], double *J[]) {
+	double *X = ws->X + i0, *dX = ws->dX + i0, *Y = ws->Y + i0, *dY = ws->dY + i0;
+	struct dual c[MAXPAR], sd, rd;
+	int i, j;
+
+	if (m->jacobian) {
+		m->jacobian (m, ws, i0, len, a, na, r, s, J);
+		return;
+	}
+
+	for (j = 0; j < na; j++) {
+		c[j] = DualConst (a[j], na);
+		c[j].d[j] = 1;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (ws->hasdx)
+			sd = DualSigma (DualMulC (DualSub (m->dual (X[i] + dX[i], c, na), m->dual (X[i] - dX[i], c, na), na), 0.5, na),
+							dY[i], na);
+		else
+			sd = DualConst (dY[i], na);
+		rd = DualResidual (m->dual (X[i], c, na), sd, Y[i], na);
+
+		r[i] = rd.v;
+		s[i] = sd.v;
+		for (j = 0; j < na; j++)
+			J[j][i] = rd.d[j];
+	}
+}
+
+// chi^2 of the data bound to ws, without storing the residuals: only reads ws, so it can
+// run on several threads at once.
+static double Chi2Only (const struct fitmodel *m, struct fitworkspace *ws, double a[], int na) {
+	double r[SIMD_BLOCK], s[SIMD_BLOCK], chi2 = 0;
+	int i, k, len, n = ws->n;
+
+	for (i = 0; i < n; i += len) {
+		len = n - i < SIMD_BLOCK ? n - i : SIMD_BLOCK;
+		ResidualBlock (m, ws, i, len, a, na, r, s);
+		for (k = 0; k < len; k++)
+			chi2 += r[k] * r[k];
+	}
+
 	return chi2;
 }
 
-// Calculates the gradient at a point in parameter space.
-static double *CalcGrad (double (*func)(double, double *, int), double X[], double dX[], double Y[], double dY[],
-						 int n, double a[], int na, double stepsize[]) {
-	double c[na], chisq1, chisq2, da, t = 0;
-	static double grad[11];
-	int i;
-	
-	Copy1D (a, na, grad);
-	chisq2 = CalcChi2 (func, X, dX, Y, dY, n, a, na);
+// Runs func on every item of array inarray and returns array of evaluated values.
+// Built-in fit functions are evaluated by their array kernels, so Yout must not overlap Xin.
+void FEvalArray (double (*func)(double, double *, int), double Xin[], double Yout[], int n,
+				 double a[], int na) {
+	struct fitmodel model = FuncModel (func);
+
+	ModelEvalArray (&model, Xin, Yout, n, a, na);
+}
+
+// Calculates chi2 using input coefficients, in a single pass over the data.
+// Formula: sum ( ( y - f(x) )^2 / ( dy^2 + ( df/dx dx )^2 ) ) for the built-in models, with
+// ( f(x+dx) - f(x-dx) ) / 2 in place of df/dx dx for other functions.
+// The x error terms are skipped if all dx are 0. NaN unless 1 <= na <= MAXPAR: the model kernels
+// are specialized on that many parameters at most.
+double CalcChi2 (double (*func)(double, double *, int), double X[], double dX[], double Y[], double dY[],
+				 int n, double a[], int na) {
+	struct fitmodel model = FuncModel (func);
+	struct fitworkspace ws;
+
+	if (na < 1 || na > MAXPAR)
+		return NAN;
+
+	memset (&ws, 0, sizeof (ws));
+	BindData (&ws, X, dX, Y, dY, n);
+
+	return Chi2Only (&model, &ws, a, na);
+}
+
+// Same as CalcChi2 for the data bound to ws. Also stores the weighted residuals ( y - f(x) ) / sigma
+// and sigma of every point in ws->res and ws->sig. Doesn't allocate memory.
+double CalcChi2Ws (const struct fitmodel *m, struct fitworkspace *ws, double a[], int na) {
+	double chi2 = 0;
+	int i, k, len, n = ws->n;
+
+	if (na < 1 || na > MAXPAR)
+		return NAN;
+
+	for (i = 0; i < n; i += len) {
+		len = n - i < SIMD_BLOCK ? n - i : SIMD_BLOCK;
+		ResidualBlock (m, ws, i, len, a, na, ws->res + i, ws->sig + i);
+		for (k = i; k < i + len; k++)
+			chi2 += ws->res[k] * ws->res[k];
+	}
+
+	return chi2;
+}
+
+// Counts nchi2 chi^2 evaluations, and the model evaluations of npass passes over the data.
+static void CountEvals (struct fitcontext *ctx, int nchi2, int npass) {
+
+	ctx->stats.nchi2 += nchi2;
+	ctx->stats.neval += (long long)npass * ctx->ws->n * (ctx->ws->hasdx && !ctx->m->slope ? 3 : 1);
+}
+
+static void AddStats (struct fitstats *to, const struct fitstats *from) {
+
+	to->nchi2 += from->nchi2;
+	to->neval += from->neval;
+	to->ncut += from->ncut;
+}
+
+// Records an iteration in the trace of ctx, if any: the step from aold to a, and chi^2 at a.
+static void Trace (struct fitcontext *ctx, int iter, double chi2, const double aold[], const double a[]) {
+	struct fittracepoint *p;
+	double step = 0;
+	int j;
+
+	if (!ctx->trace || ctx->trace->cap < 1)
+		return;
+
+	p = &ctx->trace->points[ctx->trace->n % ctx->trace->cap];
+	for (j = 0; j < ctx->na; j++)
+		step += (a[j] - aold[j]) * (a[j] - aold[j]);
+	p->iter = iter;
+	p->chi2 = chi2;
+	p->step = sqrt (step);
+	memcpy (p->a, a, ctx->na * sizeof (double));
+	if (ctx->trace->n < INT_MAX)
+		ctx->trace->n++;
+}
+
+// 1 if the evaluation or time budget of ctx is used up.
+static int OverBudget (const struct fitcontext *ctx) {
+
+	return (ctx->stop.maxeval > 0 && ctx->stats.neval >= ctx->stop.maxeval)
+		   || (ctx->stop.deadline > 0 && FitClock () >= ctx->stop.deadline);
+}
+
+// 1 if a step from aold (chi^2 chiold) to a (chi^2 chi2) meets the tolerances of ctx.
+static int Converged (const struct fitcontext *ctx, double chiold, double chi2, const double aold[],
+					  const double a[]) {
+	int j;
+
+	if (fabs (chiold - chi2) <= ctx->stop.atol)
+		return 1;
+	if (ctx->stop.rtol > 0 && fabs (chiold - chi2) <= ctx->stop.rtol * fabs (chi2))
+		return 1;
+	if (ctx->stop.xtol > 0) {
+		for (j = 0; j < ctx->na; j++)
+			if (fabs (a[j] - aold[j]) > ctx->stop.xtol * fabs (a[j]))
+				return 0;
+		return 1;
+	}
+	return 0;
+}
+
+// Index of a in the memo of ctx, or -1.
+static int MemoFind (const struct fitcontext *ctx, const double a[]) {
+	int k;
+
+	for (k = 0; k < ctx->nmemo; k++)
+		if (memcmp (ctx->memoa[k], a, ctx->na * sizeof (double)) == 0)
+			return k;
+
+	return -1;
+}
+
+// Remembers chi^2 at a, replacing the oldest entry when the memo is full.
+static void MemoAdd (struct fitcontext *ctx, const double a[], double chi2) {
+
+	memcpy (ctx->memoa[ctx->memonext], a, ctx->na * sizeof (double));
+	ctx->memochi2[ctx->memonext] = chi2;
+	ctx->memonext = (ctx->memonext + 1) % MEMOSIZE;
+	if (ctx->nmemo < MEMOSIZE)
+		ctx->nmemo++;
+}
+
+// chi^2 at a, computed only if it's not in the memo.
+static double Chi2 (struct fitcontext *ctx, double a[]) {
+	double chi2;
+	int k;
+
+	if ((k = MemoFind (ctx, a)) >= 0)
+		return ctx->memochi2[k];
+
+	chi2 = Chi2Only (ctx->m, ctx->ws, a, ctx->na);
+	CountEvals (ctx, 1, 1);
+	MemoAdd (ctx, a, chi2);
+	return chi2;
+}
+
+// Same as Chi2, and also makes ws->res and ws->sig hold the residuals at a.
+static double Chi2Res (struct fitcontext *ctx, double a[]) {
+	double chi2;
+	int k = MemoFind (ctx, a);
+
+	if (k >= 0 && ctx->hasres && memcmp (ctx->resa, a, ctx->na * sizeof (double)) == 0)
+		return ctx->memochi2[k];
+
+	chi2 = CalcChi2Ws (ctx->m, ctx->ws, a, ctx->na);
+	CountEvals (ctx, 1, 1);
+	memcpy (ctx->resa, a, ctx->na * sizeof (double));
+	ctx->hasres = 1;
+	if (k < 0)
+		MemoAdd (ctx, a, chi2);
+	return chi2;
+}
+
+// Calculates the gradient at a point in parameter space into grad, and the norm of the chi^2
+// gradient into gnorm. Returns 0 if the gradient is zero (grad is then left at 0).
+static int CalcGrad (struct fitcontext *ctx, double a[], double stepsize[], double grad[], double *gnorm) {
+	int i, na = ctx->na;
+	double c[na], alpha[na * na], beta[na], chisq1, chisq2, da, t = 0, g = 0;
 	
-	for (i = 0; i < na; i++) {
-		Copy1D (a, na, c);
-		da = 0.01 * stepsize[i];
-		c[i] += da;
-		chisq1 = CalcChi2 (func, X, dX, Y, dY, n, c, na);
-		grad[i] = chisq2 - chisq1;
+	// The exact gradient is -2 beta, and grad the decrease of chi^2 over each step da.
+	if (HasJacobian (ctx->m)) {
+		NormalEquations (ctx, a, alpha, beta);
+		for (i = 0; i < na; i++) {
+			grad[i] = 2 * beta[i] * 0.01 * stepsize[i];
+			g += 4 * beta[i] * beta[i];
+		}
 	}
+	else {
+		chisq2 = Chi2 (ctx, a);
+		
+		for (i = 0; i < na; i++) {
+			memcpy (c, a, na * sizeof (double));
+			da = 0.01 * stepsize[i];
+			c[i] += da;
+			chisq1 = Chi2 (ctx, c);
+			grad[i] = chisq2 - chisq1;
+			g += (grad[i] / da) * (grad[i] / da);
+		}
+	}
+	*gnorm = sqrt (g);
 	
 	for (i = 0; i < na; i++)
 		t += grad[i] * grad[i];
+	if (t == 0)
+		return 0;
 	
 	for (i = 0; i < na; i++)
 		grad[i] *= stepsize[i] / sqrt (t);
-	
-	return grad;
+	return 1;
 }
 
 // Calculates the (negative) chi^2 gradient at the current point
 // in parameter space, and moves in that direction until a minimum is found.
 // Returns the new value of the parameters and the total length travelled.
-static struct gradstep GradStep (double (*func)(double, double *, int), double X[], double dX[], double Y[],
-								 double dY[], int n, double a[], int na, double stepsize[], double stepdown, int iter) {
+static struct gradstep GradStep (struct fitcontext *ctx, double a[], double stepsize[], double stepdown,
+								 int iter, int maxiter) {
 	double chi1, chi2, chi3, step;
-	static double grad[11], anew[11];
-	int i;
+	int i, na = ctx->na;
 	struct gradstep gradst;
 	gradst.stopflag = 0;
 	gradst.stepsum = 0;
 	gradst.iter = iter;
-	gradst.anew = anew;
-	gradst.grad = grad;
 	
-	chi2 = CalcChi2 (func, X, dX, Y, dY, n, a, na);
-	gradst.grad = CalcGrad (func, X, dX, Y, dY, n, a, na, stepsize);
+	chi2 = Chi2 (ctx, a);
+	if (!CalcGrad (ctx, a, stepsize, gradst.grad, &gradst.gnorm)) {
+		memcpy (gradst.anew, a, na * sizeof (double));
+		gradst.stopflag = 4;
+		return gradst;
+	}
+	if (!isfinite (gradst.gnorm)) {
+		memcpy (gradst.anew, a, na * sizeof (double));
+		gradst.stopflag = 3;
+		return gradst;
+	}
 	chi3 = 1.1 * chi2;			
 	chi1 = chi3;
 	
-	// Cut down the step size until a single step yields a decrease in chi^2.
+	// Cut down the step size until a single step yields a decrease in chi^2 (NaN counts as
+	// an increase). The first pass only undoes the doubling.
 	stepdown *= 2;
+	ctx->stats.ncut--;
 	
-	for ( ; chi3 > chi2; gradst.iter++) {
+	for ( ; !(chi3 <= chi2); gradst.iter++) {
 		stepdown = stepdown / 2;
+		ctx->stats.ncut++;
 		for (i = 0; i < na; i++) 
 			gradst.anew[i] = a[i] + stepdown * gradst.grad[i];
-		chi3 = CalcChi2 (func, X, dX, Y, dY, n, gradst.anew, na);
+		chi3 = Chi2 (ctx, gradst.anew);
 		
-		if (gradst.iter > MAXITER) {
+		if (gradst.iter > maxiter) {
 			gradst.stopflag = 1;
 			break;
 		}
+		if (OverBudget (ctx)) {
+			gradst.stopflag = 2;
+			break;
+		}
 	}
 	
 	// Keep going until a minimum is passed.
@@ -157,14 +517,25 @@ static struct gradstep GradStep (double (*func)(double, double *, int), double X
 		
 		for (i = 0; i < na; i++)
 			gradst.anew[i] += gradst.grad[i] * stepdown;	
-  		chi3 = CalcChi2 (func, X, dX, Y, dY, n, gradst.anew, na);
+  		chi3 = Chi2 (ctx, gradst.anew);
 		
-		if (gradst.iter > MAXITER) {
+		if (gradst.iter > maxiter) {
 			gradst.stopflag = 1;
 			break;
 		}
+		if (OverBudget (ctx)) {
+			gradst.stopflag = 2;
+			break;
+		}
 	}
 	
+	// The model is undefined past the last point, so there's no parabola: stop there.
+	if (!isfinite (chi3)) {
+		for (i = 0; i < na; i++)
+			gradst.anew[i] -= stepdown * gradst.grad[i];
+		return gradst;
+	}
+
 	// Approximate the minimum as a parabola.
 	step = stepdown * ((chi3 - chi2) / (chi1 - 2 * chi2 + chi3) + 0.5);
 	for (i = 0; i < na; i++)
@@ -173,95 +544,783 @@ static struct gradstep GradStep (double (*func)(double, double *, int), double X
 	return gradst;
 }
 
-// Calculates the errors on the final fitted parameters by approximating the minimum
-// as parabolic in each parameter.
-static struct errors Errors (double (*func)(double, double *, int), double X[], double dX[], double Y[],
-							 double dY[], int n, double a[], int na, double stepsize[]) {
-	double da[na], a1[na], a2[na], a3[na], dChi2da[na][na], err[na], cov[na][na];
-	static struct errors errs;
-	errs.err = err;
-	errs.cov = cov;
-	int i, j, k;
-	
-	for (i = 0; i < na; i++) {
-		da[i] = stepsize[i];
-		
-		Copy1D (a, na, a1);
-		a1[i] += da[i];
-		
-		Copy1D (a, na, a2);
-		Copy1D (a1, na, a3);
-		
+// Sums of NormalEquations over chunk t of the data. J is computed one block of points at a time
+// and never stored whole. Only reads ws, so chunks can run on several threads at once.
+static void NormalChunk (void *arg, int t) {
+	struct normaleq *ne = arg;
+	const struct fitmodel *m = ne->ctx->m;
+	struct fitworkspace *ws = ne->ctx->ws;
+	int i, i0, i1, j, k, len, na = ne->ctx->na;
+	double J[MAXPAR][SIMD_BLOCK], s[SIMD_BLOCK], rj[SIMD_BLOCK], c[MAXPAR], *alpha = ne->alpha[t], *beta = ne->beta[t];
+	double *Jrow[MAXPAR], *r;
+
+	i1 = (t + 1) * ne->chunk < ws->n ? (t + 1) * ne->chunk : ws->n;
+	memcpy (c, ne->a, na * sizeof (double));
+	for (j = 0; j < na; j++)
+		Jrow[j] = J[j];
+	memset (alpha, 0, na * na * sizeof (double));
+	memset (beta, 0, na * sizeof (double));
+
+	for (i0 = t * ne->chunk; i0 < i1; i0 += len) {
+		len = i1 - i0 < SIMD_BLOCK ? i1 - i0 : SIMD_BLOCK;
+		if (HasJacobian (m)) {
+			JacobianBlock (m, ws, i0, len, c, na, rj, s, Jrow);
+			r = rj;
+		}
+		else {
+			r = ws->res + i0;
+			for (j = 0; j < na; j++) {
+				c[j] = ne->a[j] + ne->h[j];
+				ResidualBlock (m, ws, i0, len, c, na, J[j], s);
+				c[j] = ne->a[j];
+				for (i = 0; i < len; i++)
+					J[j][i] = (J[j][i] - r[i]) / ne->h[j];
+			}
+		}
+
 		for (j = 0; j < na; j++) {
-			da[j] = stepsize[j];
-			a2[j] += da[j];
-			a3[j] += da[j];
-			dChi2da[i][j] = 0.5 * (CalcChi2 (func, X, dX, Y, dY, n, a, na) - 
-								   CalcChi2 (func, X, dX, Y, dY, n, a1, na) -
-								   CalcChi2 (func, X, dX, Y, dY, n, a2, na) + 
-								   CalcChi2 (func, X, dX, Y, dY, n, a3, na) ) / da[i] / da[j];
+			for (i = 0; i < len; i++)
+				beta[j] -= J[j][i] * r[i];
+			for (k = 0; k <= j; k++)
+				for (i = 0; i < len; i++)
+					alpha[j * na + k] += J[j][i] * J[k][i];
 		}
 	}
-	
-	InvMatrix (dChi2da, na, errs.cov);
-	
-	for (k = 0; k < na; k++)
-		errs.err[k] = sqrt (fabs (cov[k][k]));
-	
-	return errs;
 }
 
-//==============================================================================
-// Global variables
+// Builds the Gauss-Newton normal equations at a: alpha = J^T J and beta = -J^T r, where r are the
+// weighted residuals and J their Jacobian: exact in one pass for models in dual numbers, otherwise
+// by forward differences, one pass per parameter. Large datasets are split into chunks
+// run on up to ctx->nthreads threads; the chunks depend on n alone, so the result doesn't depend on
+// the no. of threads.
+static void NormalEquations (struct fitcontext *ctx, double a[], double alpha[], double beta[]) {
+	struct normaleq ne;
+	int j, k, t, nchunks, per, n = ctx->ws->n, na = ctx->na;
+	double h[MAXPAR];
 
-//==============================================================================
-// Global functions
+	if (HasJacobian (ctx->m))
+		CountEvals (ctx, 0, 1);
+	else {
+		Chi2Res (ctx, a);
+		CountEvals (ctx, 0, na);
+	}
+
+	for (j = 0; j < na; j++)
+		h[j] = sqrt (DBL_EPSILON) * (a[j] != 0 ? fabs (a[j]) : 1);
+
+	per = ((n + SIMD_BLOCK - 1) / SIMD_BLOCK + NECHUNKS - 1) / NECHUNKS;
+	if (per < NEMINBLOCKS)
+		per = NEMINBLOCKS;
+	ne.ctx = ctx;
+	ne.a = a;
+	ne.h = h;
+	ne.chunk = per * SIMD_BLOCK;
+	nchunks = (n + ne.chunk - 1) / ne.chunk;
+	FitParallelFor (ctx->nthreads, nchunks, NormalChunk, &ne);
+
+	memset (alpha, 0, na * na * sizeof (double));
+	memset (beta, 0, na * sizeof (double));
+	for (t = 0; t < nchunks; t++)
+		for (j = 0; j < na; j++) {
+			beta[j] += ne.beta[t][j];
+			for (k = 0; k <= j; k++)
+				alpha[j * na + k] += ne.alpha[t][j * na + k];
+		}
+
+	for (j = 0; j < na; j++)
+		for (k = j + 1; k < na; k++)
+			alpha[j * na + k] = alpha[k * na + j];
+}
+
+// Minimizes chi^2 by Levenberg-Marquardt: solves the damped normal equations
+// ( alpha + lambda * diag (alpha) ) da = beta, and takes the step only if chi^2 decreases.
+// a holds the initial parameters and receives the fitted ones. Returns FIT_OK or FIT_ERR_NOMIN.
+static int LevMar (struct fitcontext *ctx, double a[], int maxiter, int *iter) {
+	int j, na = ctx->na, done;
+	double alpha[na * na], beta[na], A[na * na], da[na], anew[na], lambda = LAMBDA0, dmax, chi2, chinew, g;
+
+	chi2 = Chi2Res (ctx, a);
+	NormalEquations (ctx, a, alpha, beta);
 
-/// HIFN  What does your function do?
-/// HIPAR x/What inputs does your function expect?
-/// HIRET What does your function return?
+	for (*iter = 0; *iter < maxiter; (*iter)++) {
+		// beta is minus half the chi^2 gradient.
+		g = 0;
+		for (j = 0; j < na; j++)
+			g += beta[j] * beta[j];
+		g = 2 * sqrt (g);
+		if (!isfinite (g))
+			return FIT_ERR_NAN;
+		if (ctx->stop.gtol > 0 && g <= ctx->stop.gtol)
+			return FIT_OK;
+
+		dmax = 0;
+		for (j = 0; j < na; j++)
+			if (alpha[j * na + j] > dmax)
+				dmax = alpha[j * na + j];
+
+		// Raise the damping until a step yields a decrease in chi^2.
+		for (;;) {
+			memcpy (A, alpha, na * na * sizeof (double));
+			for (j = 0; j < na; j++)
+				A[j * na + j] += lambda * (alpha[j * na + j] > 0 ? alpha[j * na + j] : DBL_EPSILON * dmax);
+
+			if (CholeskySolve (A, na, beta, da) == 0) {
+				for (j = 0; j < na; j++)
+					anew[j] = a[j] + da[j];
+				chinew = Chi2Res (ctx, anew);
+				if (chinew < chi2)
+					break;
+			}
+
+			lambda *= 10;
+			ctx->stats.ncut++;
+			if (lambda > LAMBDAMAX)
+				return FIT_OK;	// No step decreases chi^2: a is the minimum.
+			if (OverBudget (ctx))
+				return FIT_ERR_BUDGET;
+		}
+
+		Trace (ctx, *iter + 1, chinew, a, anew);
+		done = Converged (ctx, chi2, chinew, a, anew);
+		memcpy (a, anew, na * sizeof (double));
+		if (lambda > DBL_EPSILON)
+			lambda /= 10;
+
+		if (done) {
+			(*iter)++;
+			return FIT_OK;
+		}
+		if (OverBudget (ctx)) {
+			(*iter)++;
+			return FIT_ERR_BUDGET;
+		}
+
+		chi2 = chinew;
+		NormalEquations (ctx, a, alpha, beta);
+	}
+
+	return FIT_ERR_NOMIN;
+}
+
+// Fits a linear model (f = sum a_k x^k) directly by weighted least squares (Givens QR), on
+// x scaled to [-1, 1] for conditioning. The x errors are handled by effective variance: the
+// weights 1 / sigma^2 are recomputed from the last solution, as in CalcChi2Ws, until chi^2
+// settles. Writes the covariance (A^T W A)^-1 of the last solve to cov. Returns FIT_OK,
+// FIT_ERR_NOMIN if chi^2 didn't settle, or FIT_ERR_ARGS if the problem is rank deficient.
+static int LinearFit (struct fitcontext *ctx, double a[], int maxiter, int *iter, double cov[]) {
+	struct fitworkspace *ws = ctx->ws;
+	double *X = ws->X, *Y = ws->Y, row[MAXPAR], b[MAXPAR], covb[MAXPAR * MAXPAR], T[MAXPAR * MAXPAR], aold[MAXPAR];
+	double xmin = DBL_MAX, xmax = -DBL_MAX, c, h, u, t, chi2, chiprev = DBL_MAX;
+	struct lsqacc acc;
+	int i, j, k, l, n = ws->n, na = ctx->na, status = FIT_OK;
+
+	for (i = 0; i < n; i++) {
+		if (X[i] < xmin)
+			xmin = X[i];
+		if (X[i] > xmax)
+			xmax = X[i];
+	}
+	c = 0.5 * (xmax + xmin);
+	h = 0.5 * (xmax - xmin);
+	if (h == 0)
+		h = 1;
+
+	// a = T b for the coefficients b of the powers of u = (x - c) / h:
+	// T[j][k] = binom (k, j) (-c)^(k-j) / h^k.
+	memset (T, 0, sizeof (T));
+	for (k = 0; k < na; k++) {
+		t = 1 / pow (h, k);
+		for (j = k; j >= 0; j--) {
+			T[j * na + k] = t;
+			t = t * -c * j / (k - j + 1);
+		}
+	}
 
-struct fitparameters GeneralFit (double (*func)(double, double *, int), double X[], double dX[], 
-								 double Xres[], double Y[], double dY[], int n, double inita[], int na) {
-	double stepsize[na], a[na], stepdown = STEPDOWN, eps, chi1, chi2, cov[na][na], err[na];
+	// The first solve weights by dY alone.
+	for (i = 0; i < n; i++)
+		ws->sig[i] = ws->dY[i];
+	ctx->hasres = 0;
+
+	for (*iter = 0; *iter < maxiter; ) {
+		LsqInit (&acc, na);
+		for (i = 0; i < n; i++) {
+			u = (X[i] - c) / h;
+			row[0] = 1;
+			for (j = 1; j < na; j++)
+				row[j] = row[j - 1] * u;
+			LsqAddRow (&acc, row, Y[i], 1 / (ws->sig[i] * ws->sig[i]));
+		}
+		if (LsqSolve (&acc, b) < 0 || LsqCovariance (&acc, covb) < 0)
+			return FIT_ERR_ARGS;
+		(*iter)++;
+
+		memcpy (aold, a, na * sizeof (double));
+		for (j = 0; j < na; j++) {
+			a[j] = 0;
+			for (k = j; k < na; k++)
+				a[j] += T[j * na + k] * b[k];
+		}
+
+		// New weights. Without x errors they don't change, so one solve is exact.
+		chi2 = Chi2Res (ctx, a);
+		Trace (ctx, *iter, chi2, aold, a);
+		if (!ws->hasdx || Converged (ctx, chiprev, chi2, aold, a) || !isfinite (chi2))
+			break;
+		if (OverBudget (ctx)) {
+			status = FIT_ERR_BUDGET;
+			break;
+		}
+		chiprev = chi2;
+	}
+
+	// cov = T covb T^T.
+	for (i = 0; i < na; i++)
+		for (j = i; j < na; j++) {
+			t = 0;
+			for (k = i; k < na; k++)
+				for (l = j; l < na; l++)
+					t += T[i * na + k] * covb[k * na + l] * T[j * na + l];
+			cov[i * na + j] = cov[j * na + i] = t;
+		}
+
+	if (status == FIT_OK && *iter >= maxiter)
+		status = FIT_ERR_NOMIN;
+	return status;
+}
+
+// Calculates the errors on the final fitted parameters and their covariance matrix: the inverse of
+// the curvature matrix J^T W J of NormalEquations, one pass over the data. It's scaled to a unit
+// diagonal first, so that parameters of very different magnitudes keep their precision, and
+// inverted by Cholesky decomposition, or by SVD if singular (parameters the data don't determine).
+static void Errors (struct fitcontext *ctx, double a[], double err[], double cov[]) {
+	int i, j, na = ctx->na;
+	double alpha[na * na], beta[na], d[na];
+
+	NormalEquations (ctx, a, alpha, beta);
+
+	for (i = 0; i < na; i++)
+		d[i] = alpha[i * na + i] > 0 ? 1 / sqrt (alpha[i * na + i]) : 1;
+	for (i = 0; i < na; i++)
+		for (j = 0; j < na; j++)
+			alpha[i * na + j] *= d[i] * d[j];
+
+	if (CholeskyInvert (alpha, na, cov) < 0)
+		MatPseudoInvert (alpha, na, cov);
+
+	for (i = 0; i < na; i++)
+		for (j = 0; j < na; j++)
+			cov[i * na + j] *= d[i] * d[j];
+	for (i = 0; i < na; i++)
+		err[i] = sqrt (fabs (cov[i * na + i]));
+}
+
+// Steepest descent from a (the original algorithm): line searches along the gradient until
+// chi^2 stops decreasing.
+static int GradientFit (struct fitcontext *ctx, double a[], double stepsize[], int maxiter, int *iter) {
+	double stepdown = STEPDOWN, chi1, chi2;
 	struct gradstep gstep;
-	struct errors errors;
-	int i;
+	int status = FIT_OK, done;
+
 	gstep.iter = 0;
-	eps = pow (2, -52);
-	
-	for (i = 0; i < na; i++)
-		stepsize[i] = fabs (inita[i]) * 0.01 + eps;	
-	
+
 	// Initial calculation.
-	Copy1D (inita, na, a);							   
-	chi2 = CalcChi2 (func, X, dX, Y, dY, n, a, na);						
-	chi1 = chi2 + 2 * CHICUT;
-	
+	chi2 = Chi2 (ctx, a);
+
 	// Look for minimal Chisq.
-	while (fabs (chi2 - chi1) > CHICUT) {
-		gstep = GradStep (func, X, dX, Y, dY, n, a, na, stepsize, stepdown, gstep.iter);
-		Copy1D (gstep.anew, na, a);
-		stepdown = gstep.stepsum;
+	for (;;) {
+		gstep = GradStep (ctx, a, stepsize, stepdown, gstep.iter, maxiter);
+		if (gstep.stopflag == 3) {
+			status = FIT_ERR_NAN;
+			break;
+		}
+		if (gstep.stopflag == 4)
+			break;							// Already at the minimum.
 		chi1 = chi2;
-  		chi2 = CalcChi2 (func, X, dX, Y, dY, n, a, na);
-  		
+  		chi2 = Chi2 (ctx, gstep.anew);
+
+		// Out of budget halfway through a line search: keep the better end.
+		if (gstep.stopflag == 2 && !(chi2 < chi1)) {
+			status = FIT_ERR_BUDGET;
+			break;
+		}
+		if (!isfinite (chi2)) {
+			status = FIT_ERR_NAN;
+			break;
+		}
+
+		Trace (ctx, gstep.iter, chi2, a, gstep.anew);
+		done = Converged (ctx, chi1, chi2, a, gstep.anew)
+			   || (ctx->stop.gtol > 0 && gstep.gnorm <= ctx->stop.gtol);
+		memcpy (a, gstep.anew, ctx->na * sizeof (double));
+		stepdown = gstep.stepsum;
+
 		if (gstep.stopflag == 1) {
-			MessagePopup ("Error", "Can't minimize chi^2.\nTry different initial parameters.");
+			status = FIT_ERR_NOMIN;
 			break;
 		}
+		if (gstep.stopflag == 2) {
+			status = FIT_ERR_BUDGET;
+			break;
+		}
+		if (done)
+			break;
 	}
-		
+	*iter = gstep.iter;
+
+	return status;
+}
+
+// Uniform random number in [0, 1) (xorshift), from a fixed seed so fits are reproducible.
+static double Uniform (unsigned int *state) {
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return (x >> 8) / 16777216.0;
+}
+
+// Starting points of MultiStart: a itself, and a Latin hypercube sample of the box
+// a_j +- MSSPREAD (|a_j| + 0.1 max |a|) for the others. The range of every parameter
+// is cut in nstarts - 1 strata, each sampled once, in a different order per parameter.
+static void StartPoints (const double a[], int na, int nstarts, struct start starts[], int perm[]) {
+	unsigned int state = 2463534242u;
+	double amax = 0, w;
+	int i, j, k, t, m = nstarts - 1;
+
+	for (j = 0; j < na; j++)
+		if (fabs (a[j]) > amax)
+			amax = fabs (a[j]);
+
+	memcpy (starts[0].a, a, na * sizeof (double));
+	for (j = 0; j < na; j++) {
+		for (k = 0; k < m; k++)
+			perm[k] = k;
+		for (k = m - 1; k > 0; k--) {
+			i = (int)(Uniform (&state) * (k + 1));
+			t = perm[k];
+			perm[k] = perm[i];
+			perm[i] = t;
+		}
+
+		w = MSSPREAD * (fabs (a[j]) + 0.1 * amax);
+		if (w == 0)
+			w = MSSPREAD;
+		for (k = 0; k < m; k++)
+			starts[k + 1].a[j] = a[j] + w * (2 * (perm[k] + Uniform (&state)) / m - 1);
+	}
+
+	for (k = 0; k < nstarts; k++) {
+		starts[k].chi2 = DBL_MAX;
+		starts[k].iter = 0;
+		memset (&starts[k].stats, 0, sizeof (starts[k].stats));
+	}
+}
+
+// Minimizes from the point ms->run[i] for ms->maxiter iterations, with buffers of its own.
+static void StartTask (void *arg, int i) {
+	struct multistart *ms = arg;
+	struct start *s = &ms->starts[ms->run[i]];
+	struct fitworkspace ws = {0};
+	struct fitcontext ctx;
+	int iter = 0;
+
+	if (FitWorkspaceInit (&ws, ms->ws->X, ms->ws->dX, ms->ws->Y, ms->ws->dY, ms->ws->n) == FIT_OK
+		&& FitWorkspaceShare (&ws, ms->ws) == FIT_OK) {
+		memset (&ctx, 0, sizeof (ctx));
+		ctx.m = ms->m;
+		ctx.ws = &ws;
+		ctx.na = ms->na;
+		ctx.nthreads = 1;
+		ctx.stop = ms->stop;
+
+		if (ms->method == FIT_LM)
+			LevMar (&ctx, s->a, ms->maxiter, &iter);
+		else
+			GradientFit (&ctx, s->a, ms->stepsize, ms->maxiter, &iter);
+		s->iter += iter;
+		s->chi2 = Chi2 (&ctx, s->a);
+		if (!(s->chi2 < DBL_MAX))
+			s->chi2 = DBL_MAX;		// NaN
+		AddStats (&s->stats, &ctx.stats);
+	}
+
+	FitWorkspaceFree (&ws);
+}
+
+// Minimizes from nstarts points around a on up to nthreads threads, and replaces a with the
+// best minimum found. Every point gets a few iterations, then only the best 1 / MSKEEP of them
+// go on to convergence. *iter receives the iterations of the winner, and stats the work of all.
+static int MultiStart (const struct fitmodel *m, struct fitworkspace *ws, double a[], int na, double stepsize[],
+					   int method, int maxiter, int nstarts, int nthreads, const struct fitstop *stop, int *iter,
+					   struct fitstats *stats) {
+	struct multistart ms;
+	int i, k, t, nrun, *perm;
+
+	ms.starts = malloc (nstarts * sizeof (struct start));
+	ms.run = malloc (nstarts * sizeof (int));
+	perm = malloc (nstarts * sizeof (int));
+	if (!ms.starts || !ms.run || !perm) {
+		free (ms.starts);
+		free (ms.run);
+		free (perm);
+		return FIT_ERR_MEMORY;
+	}
+
+	ms.m = m;
+	ms.ws = ws;
+	ms.na = na;
+	ms.method = method;
+	ms.stepsize = stepsize;
+
+	// The points run twice at most, and leave some of the evaluations to the last run.
+	ms.stop = *stop;
+	if (ms.stop.maxeval > 0)
+		ms.stop.maxeval = ms.stop.maxeval / (2 * nstarts) + 1;
+	StartPoints (a, na, nstarts, ms.starts, perm);
+
+	// First stage: a few iterations from every point.
+	for (k = 0; k < nstarts; k++)
+		ms.run[k] = k;
+	ms.maxiter = method == FIT_LM ? MSLMITER : MSGRADITER;
+	if (ms.maxiter > maxiter)
+		ms.maxiter = maxiter;
+	FitParallelFor (nthreads, nstarts, StartTask, &ms);
+
+	// Sort by chi^2 and carry on with the best only.
+	for (k = 1; k < nstarts; k++)
+		for (i = k, t = ms.run[k]; i > 0 && ms.starts[ms.run[i - 1]].chi2 > ms.starts[t].chi2; i--) {
+			ms.run[i] = ms.run[i - 1];
+			ms.run[i - 1] = t;
+		}
+	nrun = (nstarts + MSKEEP - 1) / MSKEEP;
+	ms.maxiter = maxiter;
+	FitParallelFor (nthreads, nrun, StartTask, &ms);
+
+	for (k = 1, t = ms.run[0]; k < nrun; k++)
+		if (ms.starts[ms.run[k]].chi2 < ms.starts[t].chi2)
+			t = ms.run[k];
+	if (ms.starts[t].chi2 < DBL_MAX) {
+		memcpy (a, ms.starts[t].a, na * sizeof (double));
+		*iter = ms.starts[t].iter;
+	}
+	for (k = 0; k < nstarts; k++)
+		AddStats (stats, &ms.starts[k].stats);
+
+	free (ms.starts);
+	free (ms.run);
+	free (perm);
+	return FIT_OK;
+}
+
+//==============================================================================
+// Global variables
+
+//==============================================================================
+// Global functions
+
+// Returns a short description of a fitstatus value.
+const char *FitStatusString (int status) {
+	
+	switch (status) {
+		case FIT_OK:			return "OK";
+		case FIT_ERR_NOMIN:		return "Can't minimize chi^2. Try different initial parameters.";
+		case FIT_ERR_ARGS:		return "Invalid no. of data points or parameters.";
+		case FIT_ERR_DOMAIN:	return "Data is outside the domain of the fit function.";
+		case FIT_ERR_MEMORY:	return "Out of memory.";
+		case FIT_ERR_FILE:		return "Can't open input file.";
+		case FIT_ERR_FORMAT:	return "Input data is in wrong format. Make sure it contains a 4 column table.";
+		case FIT_ERR_NAN:		return "chi^2 or its gradient is not a number. The fit function may be undefined or overflow at the parameters.";
+		case FIT_ERR_BUDGET:	return "Time or evaluation limit reached.";
+		default:				return "Unknown error.";
+	}
+}
+
+// Binds ws to the data points (X +- dX, Y +- dY), growing its buffers if needed. ws must be
+// zeroed before its first use, and can then be reused for any number of datasets and fits.
+int FitWorkspaceInit (struct fitworkspace *ws, double X[], double dX[], double Y[], double dY[], int n) {
+	double *p;
+
+	// res and sig share one block, which is only ever overwritten: no need to keep it on growth.
+	if (n > ws->cap) {
+		if (n > INT_MAX / 2 || !(p = malloc (2 * (size_t)n * sizeof (double))))
+			return FIT_ERR_MEMORY;
+		free (ws->res);
+		ws->res = p;
+		ws->sig = p + n;
+		ws->cap = n;
+	}
+
+	BindData (ws, X, dX, Y, dY, n);
+
+	return FIT_OK;
+}
+
+// Computes the data features (fitfeature flags) that aren't cached in ws yet, for the residual
+// kernels of the models that use them. Call FitWorkspaceInit again if the data changes.
+int FitWorkspaceFeatures (struct fitworkspace *ws, int features) {
+	double *p, *X = ws->X;
+	int i, n = ws->n;
+
+	if ((features & FIT_FEAT_LOGX) && !(ws->features & FIT_FEAT_LOGX)) {
+		if (n > ws->logxcap) {
+			if (!(p = realloc (ws->logxcap ? ws->logx : NULL, (size_t)n * sizeof (double))))
+				return FIT_ERR_MEMORY;
+			ws->logx = p;
+			ws->logxcap = n;
+		}
+		for (i = 0; i < n; i++)
+			ws->logx[i] = log (fabs (X[i]));
+		ws->features |= FIT_FEAT_LOGX;
+	}
+
+	return FIT_OK;
+}
+
+// Frees the buffers of ws.
+void FitWorkspaceFree (struct fitworkspace *ws) {
+
+	free (ws->res);
+	if (ws->logxcap)
+		free (ws->logx);
+	memset (ws, 0, sizeof (*ws));
+}
+
+/// HIFN  Makes ws use the data features cached in src (see FitWorkspaceFeatures) rather than
+/// HIFN  compute its own, for datasets sharing the X and dX arrays of src (e.g. spectra on one
+/// HIFN  grid). Call after every FitWorkspaceInit of ws. src must be kept until the fits end.
+/// HIRET FIT_OK, or FIT_ERR_ARGS if ws and src aren't bound to the same X and dX.
+
+int FitWorkspaceShare (struct fitworkspace *ws, const struct fitworkspace *src) {
+
+	if (ws->X != src->X || ws->dX != src->dX || ws->n != src->n)
+		return FIT_ERR_ARGS;
+
+	if (ws->logxcap)
+		free (ws->logx);
+	ws->logx = src->logx;
+	ws->logxcap = 0;
+	ws->features = src->features;
+
+	return FIT_OK;
+}
+
+// Sets opt to the default fit options (Levenberg-Marquardt).
+void FitDefaultOptions (struct fitoptions *opt) {
+
+	memset (opt, 0, sizeof (*opt));
+	opt->method = FIT_LM;
+	opt->atol = CHICUT;
+}
+
+/// HIFN  Fits func to the data points (X +- dX, Y +- dY) starting from inita, with the default options.
+/// HIFN  On failure, the status field of the result is set: FIT_ERR_NOMIN is
+/// HIFN  returned along with the last parameters when chi^2 can't be minimized,
+/// HIFN  FIT_ERR_NAN at once when the function is undefined at the parameters.
+/// HIRET The fitted parameters, their errors and covariance, and goodness of fit.
+
+struct fitparameters GeneralFit (double (*func)(double, double *, int), double X[], double dX[],
+								 double Y[], double dY[], int n, double inita[], int na) {
+	struct fitoptions opt;
+
+	FitDefaultOptions (&opt);
+	return GeneralFitEx (func, X, dX, Y, dY, n, inita, na, &opt);
+}
+
+/// HIFN  Same as GeneralFit, with the minimization method and limits set by opt.
+/// HIPAR opt/Fit options, see FitDefaultOptions. NULL for the defaults.
+
+struct fitparameters GeneralFitEx (double (*func)(double, double *, int), double X[], double dX[],
+								   double Y[], double dY[], int n, double inita[], int na, const struct fitoptions *opt) {
+	struct fitmodel model = FuncModel (func);
+	struct fitworkspace ws = {0};
+	struct fitparameters fit;
+
+	memset (&fit, 0, sizeof (fit));
+	if ((fit.status = FitWorkspaceInit (&ws, X, dX, Y, dY, n)) < 0) {
+		fit.na = na;
+		return fit;
+	}
+
+	fit = GeneralFitWs (&model, &ws, inita, na, opt);
+	FitWorkspaceFree (&ws);
+
+	return fit;
+}
+
+/// HIFN  Same as GeneralFitEx, for the data bound to ws by FitWorkspaceInit.
+/// HIFN  Reusing ws for many fits avoids any memory allocation during the fit.
+/// HIFN  With opt->warm set, the fit starts from that previous fit (its parameters and
+/// HIFN  step sizes) instead of inita, which may then be NULL. The previous fit must have na
+/// HIFN  parameters (FIT_ERR_ARGS otherwise).
+
+struct fitparameters GeneralFitWs (const struct fitmodel *model, struct fitworkspace *ws,
+								   double inita[], int na, const struct fitoptions *opt) {
+	double stepsize[MAXPAR], a[MAXPAR], eps, t0 = FitClock (), th;
+	struct fitoptions defopt;
+	struct fitparameters fit;
+	struct fitcontext ctx;
+	int i, maxiter, direct = 0, msiter = 0, n = ws->n;
+
+	memset (&fit, 0, sizeof (fit));
+	fit.na = na;
+	if (n < 1 || na < 1 || na > MAXPAR) {
+		fit.status = FIT_ERR_ARGS;
+		return fit;
+	}
+
+	if (!opt) {
+		FitDefaultOptions (&defopt);
+		opt = &defopt;
+	}
+	if (opt->warm ? opt->warm->na != na : !inita) {
+		fit.status = FIT_ERR_ARGS;
+		return fit;
+	}
+
+	eps = DBL_EPSILON;
+
+	// A warm start keeps the step sizes too: the parameters may be near 0 by now.
+	if (opt->warm) {
+		inita = (double *)opt->warm->a;
+		memcpy (stepsize, opt->warm->stepsize, na * sizeof (double));
+	}
+	else
+		for (i = 0; i < na; i++)
+			stepsize[i] = fabs (inita[i]) * 0.01 + eps;
+
+	memcpy (a, inita, na * sizeof (double));
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.m = model;
+	ctx.ws = ws;
+	ctx.na = na;
+	ctx.nthreads = opt->nthreads;
+	ctx.trace = opt->trace;
+	if (ctx.trace)
+		ctx.trace->n = 0;
+	ctx.stop.atol = opt->atol;
+	ctx.stop.rtol = opt->rtol;
+	ctx.stop.xtol = opt->xtol;
+	ctx.stop.gtol = opt->gtol;
+	ctx.stop.deadline = opt->maxtime > 0 ? t0 + opt->maxtime : 0;
+	ctx.stop.maxeval = opt->maxeval;
+
+	// Without the cache the kernels compute the features on the fly, so this can fail.
+	if (model->features)
+		FitWorkspaceFeatures (ws, model->features);
+
+	// Linear models in a single solve, or a few with x errors. Falls back to LM if rank deficient.
+	if (opt->method == FIT_LM && model->linear) {
+		maxiter = opt->maxiter > 0 ? opt->maxiter : LINMAXITER;
+		fit.status = LinearFit (&ctx, a, maxiter, &fit.iter, fit.cov);
+		direct = (fit.status != FIT_ERR_ARGS);
+		if (!direct)
+			memcpy (a, inita, na * sizeof (double));
+	}
+
+	if (!direct) {
+		if (opt->method == FIT_LM)
+			maxiter = opt->maxiter > 0 ? opt->maxiter : LMMAXITER;
+		else
+			maxiter = opt->maxiter > 0 ? opt->maxiter : MAXITER;
+
+		// Fail fast where the model is undefined to start with (e.g. EXP overflow, LOG of x <= 0).
+		if (!isfinite (Chi2Res (&ctx, a)))
+			fit.status = FIT_ERR_NAN;
+		else {
+			// The best of many starting points, then a last run from it, as a single start fit.
+			if (opt->nstarts > 1)
+				fit.status = MultiStart (model, ws, a, na, stepsize, opt->method, maxiter, opt->nstarts,
+										 opt->nthreads, &ctx.stop, &msiter, &ctx.stats);
+
+			// Out of memory there, the initial parameters are returned with the error.
+			if (fit.status >= 0) {
+				if (opt->method == FIT_LM)
+					fit.status = LevMar (&ctx, a, maxiter, &fit.iter);
+				else
+					fit.status = GradientFit (&ctx, a, stepsize, maxiter, &fit.iter);
+				fit.iter += msiter;
+			}
+		}
+	}
+
 	// Calculate the returned values.
-	struct fitparameters fit = {gstep.iter, a, err, cov, CalcChi2 (func, X, dX, Y, dY, n, a, na), n - na}; 
+	memcpy (fit.a, a, na * sizeof (double));
+	memcpy (fit.stepsize, stepsize, na * sizeof (double));
+	fit.chisq = Chi2Res (&ctx, a);
+	fit.ndf = n - na;
 	fit.rchisq = fit.chisq / fit.ndf;
-	FEvalArray (func, Xres, fit.fittedY, 5000, a, na);
-	XX_Dist (fit.chisq, fit.ndf, &fit.pprob);
-	fit.pprob = 1 - fit.pprob;
-	errors = Errors (func, X, dX, Y, dY, n, a, na, stepsize);
-	fit.aerr = errors.err;
-	fit.cov = errors.cov;
+	fit.pprob = ChiSqProb (fit.chisq, fit.ndf);
+	if (!isfinite (fit.chisq))
+		fit.status = FIT_ERR_NAN;		// No errors either.
+	else if (direct)
+		for (i = 0; i < na; i++)
+			fit.aerr[i] = sqrt (fabs (fit.cov[i * na + i]));
+	else {
+		th = FitClock ();
+		Errors (&ctx, a, fit.aerr, fit.cov);
+		ctx.stats.thessian = FitClock () - th;
+	}
+	fit.stats = ctx.stats;
+	fit.stats.tfit = FitClock () - t0;
 	
 	return fit;	
 }
 
+
+// Writes x as a JSON number, or null if it's inf or NaN.
+static void PutJsonNumber (FILE *f, double x) {
+
+	if (isfinite (x))
+		fprintf (f, "%.17g", x);
+	else
+		fputs ("null", f);
+}
+
+/// HIFN  Writes the result, work counters and timers of a fit, and the iterations in trace
+/// HIFN  (if not NULL), to a JSON file: to see where a slow fit spent its time.
+/// HIRET FIT_OK or FIT_ERR_FILE.
+
+int WriteFitJson (const char *path, const struct fitparameters *fit, const struct fittrace *trace) {
+	const struct fitstats *s = &fit->stats;
+	const struct fittracepoint *p;
+	int i, j, k0;
+	FILE *f;
+
+	if (!(f = fopen (path, "w")))
+		return FIT_ERR_FILE;
+
+	fprintf (f, "{\n  \"status\": %d,\n  \"iter\": %d,\n  \"chi2\": ", fit->status, fit->iter);
+	PutJsonNumber (f, fit->chisq);
+	fprintf (f, ",\n  \"a\": [");
+	for (j = 0; j < fit->na; j++) {
+		fputs (j ? ", " : "", f);
+		PutJsonNumber (f, fit->a[j]);
+	}
+	fprintf (f, "],\n  \"stats\": {\"nchi2\": %lld, \"neval\": %lld, \"ncut\": %lld, \"fit_s\": %.9g, "
+			 "\"hessian_s\": %.9g, \"guess_s\": %.9g}", s->nchi2, s->neval, s->ncut, s->tfit, s->thessian, s->tguess);
+
+	if (trace && trace->cap > 0) {
+		fprintf (f, ",\n  \"trace\": [");
+		k0 = trace->n > trace->cap ? trace->n - trace->cap : 0;
+		for (i = k0; i < trace->n; i++) {
+			p = &trace->points[i % trace->cap];
+			fprintf (f, "%s\n    {\"iter\": %d, \"chi2\": ", i > k0 ? "," : "", p->iter);
+			PutJsonNumber (f, p->chi2);
+			fprintf (f, ", \"step\": ");
+			PutJsonNumber (f, p->step);
+			fprintf (f, ", \"a\": [");
+			for (j = 0; j < fit->na; j++) {
+				fputs (j ? ", " : "", f);
+				PutJsonNumber (f, p->a[j]);
+			}
+			fprintf (f, "]}");
+		}
+		fprintf (f, "\n  ]");
+	}
+	fprintf (f, "\n}\n");
+
+	return fclose (f) ? FIT_ERR_FILE : FIT_OK;
+}
@@ -0,0 +1,73 @@
+//==============================================================================
+//
+// Title:		warmstart.c
+// Purpose:		Test of GeneralFitWs warm starts: a previous fit with another
+//				no. of parameters and no inita must be rejected, not read past.
+//
+// Created by: Shaked Tuval, 2021
+// License:    MIT License (see LICENSE file)
+//
+//==============================================================================
+
+//==============================================================================
+// Include files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curvifit.h"
+
+
+//==============================================================================
+// Global functions
+
+int main (void) {
+	double X[] = {0, 1, 2, 3, 4}, dX[5] = {0}, Y[] = {1, 2, 3, 4, 5}, dY[] = {1, 1, 1, 1, 1};
+	double inita[] = {1, 1};
+	struct fitworkspace ws;
+	struct fitoptions opt;
+	struct fitparameters prev, fit;
+	int failed = 0;
+
+	memset (&ws, 0, sizeof (ws));
+	if (FitWorkspaceInit (&ws, X, dX, Y, dY, 5) < 0) {
+		fprintf (stderr, "FitWorkspaceInit failed.\n");
+		return EXIT_FAILURE;
+	}
+	FitDefaultOptions (&opt);
+
+	// A straight line to warm start from...
+	prev = GeneralFitWs (GetFitModel (LIN), &ws, inita, 2, &opt);
+	if (prev.status < 0) {
+		fprintf (stderr, "Linear fit failed (%d).\n", prev.status);
+		failed = 1;
+	}
+
+	// ...for a parabola, without inita.
+	opt.warm = &prev;
+	fit = GeneralFitWs (GetFitModel (POLY), &ws, NULL, 3, &opt);
+	if (fit.status != FIT_ERR_ARGS) {
+		fprintf (stderr, "Warm start with na %d for na 3: status %d, not FIT_ERR_ARGS.\n", prev.na, fit.status);
+		failed = 1;
+	}
+
+	// No warm start and no inita.
+	opt.warm = NULL;
+	fit = GeneralFitWs (GetFitModel (LIN), &ws, NULL, 2, &opt);
+	if (fit.status != FIT_ERR_ARGS) {
+		fprintf (stderr, "No inita: status %d, not FIT_ERR_ARGS.\n", fit.status);
+		failed = 1;
+	}
+
+	// The same warm start with the right na fits.
+	opt.warm = &prev;
+	fit = GeneralFitWs (GetFitModel (LIN), &ws, NULL, 2, &opt);
+	if (fit.status < 0) {
+		fprintf (stderr, "Warm start with na 2: status %d.\n", fit.status);
+		failed = 1;
+	}
+
+	FitWorkspaceFree (&ws);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}